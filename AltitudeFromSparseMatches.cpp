@@ -0,0 +1,248 @@
+//===============================================================================//
+//                                                                               //
+// This function computes the altitude of the camera from a joined stereo pair   //
+// without building a dense disparity map. Corner features are detected in the   //
+// left image and only those points are rectified (undistortPoints). Small       //
+// rectified patches around them are then matched along the same rectified row   //
+// of the right image, and the distances of the matches are corrected for water  //
+// using the refraction index of salt water (1.33).                              //
+//                                                                               //
+// Only the patches that are matched are rectified (and demosaiced in the case   //
+// of a raw image), which takes a small fraction of the time of a dense match.   //
+//                                                                               //
+// Input:   image             Input image pair (joined left and right)           //
+//          cameraMatrix      Camera calibration matrices                        //
+//          rectify           False if the image pair is already rectified       //
+//          cfaPattern        Bayer pattern if image is a raw (CFA) image pair   //
+// Output:  returned value    Mean, median, min and max distances in mm of the   //
+//                            matched features after outliers are removed (the   //
+//                            point cloud data is left empty)                    //
+//                                                                               //
+//===============================================================================//
+
+#include "AltitudeFromSparseMatches.h"
+#include "RectifyImage.h"
+#include "demosaic.hpp"
+#include "FrameLog.h"
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+
+using namespace cv;
+using namespace std;
+
+// fixed-point identity maps for a region (used when the pair is already rectified)
+static void IdentityMaps(Rect region, Mat &map1, Mat &map2)
+{
+	map1.create(region.size(), CV_16SC2);
+	map2 = Mat::zeros(region.size(), CV_16UC1);
+	for (int y=0; y<region.height; y++)
+	{
+		short *m = map1.ptr<short>(y);
+		for (int x=0; x<region.width; x++)
+		{
+			m[2*x] = (short)(region.x + x);
+			m[2*x+1] = (short)(region.y + y);
+		}
+	}
+}
+
+// rectify one region of an image half into a single channel (green) floating point patch
+static void RectifyRegion(Mat imageHalf, Mat map1, Mat map2, string cfaPattern, Mat &patch)
+{
+	Mat rectified, rectifiedGreen;
+	if (!cfaPattern.empty())
+		demosaic_remap(imageHalf, rectified, map1, map2, cfaPattern, 1);
+	else
+	{
+		remap(imageHalf, rectified, map1, map2, INTER_LINEAR, BORDER_CONSTANT);
+		if (rectified.channels() == 3)
+		{
+			extractChannel(rectified, rectifiedGreen, 1);
+			rectified = rectifiedGreen;
+		}
+	}
+	rectified.convertTo(patch, CV_32F);
+}
+
+
+PointCloud AltitudeFromSparseMatches(Mat image, const CameraMatrix &cameraMatrix, bool rectify, string cfaPattern)
+{
+	PointCloud pointCloud;
+	pointCloud.meanDistance = pointCloud.minDistance = pointCloud.maxDistance = pointCloud.medianDistance = 0.f;
+
+	int maxFeatures = 2000;				// number of corners detected in the left image
+	double featureQuality = 0.01;		// minimum corner strength relative to the strongest corner
+	double featureSpacing = 10.;		// minimum distance between corners in pixels
+	int halfPatch = 5;					// matched patches are 11x11 pixels
+	float minScore = 0.8f;				// minimum normalized correlation of a match
+	float minScoreMargin = 0.05f;		// a match must beat every match more than 2 pixels away by this much
+	int minMatches = 20;				// fewer matches than this gives no altitude
+	double outlierMADs = 3.;			// matches further than this many (scaled) deviations from the median are outliers
+
+	int minDisparity = 207;				// lower limit of disparity (725500 / 207 disparity = 3500mm distance of camera)
+	int maxDisparity = 16*25 + 25;		// upper limit of disparity (the dense search range plus the edge trim)
+	float waterRefractionIndex = 1.33f;	// 1.33 for salt water
+
+	// the halves are views into the joined image
+	int halfWidth = image.cols/2;
+	Mat imageLeft = image(Rect(0, 0, halfWidth, image.rows));
+	Mat imageRight = image(Rect(halfWidth, 0, halfWidth, image.rows));
+	Size imageSize = imageLeft.size();
+
+	// the right half starts on an odd column when the half width is odd, which swaps the pattern columns
+	string cfaPatternRight = cfaPattern;
+	if (!cfaPattern.empty() && halfWidth % 2 != 0)
+	{
+		swap(cfaPatternRight[0], cfaPatternRight[1]);
+		swap(cfaPatternRight[2], cfaPatternRight[3]);
+	}
+
+	// get an 8 bit single channel version of the left image to detect features in (the green
+	// pixels of a raw image at half resolution)
+	Mat imageDetect;
+	float detectScale = 1.f, detectOffsetX = 0.f, detectOffsetY = 0.f;
+	if (!cfaPattern.empty())
+	{
+		string pattern = cfaPattern;
+		transform(pattern.begin(), pattern.end(), pattern.begin(), ::tolower);
+		int greenIndex = (int)pattern.find('g');
+		cfa_channel(imageLeft, imageDetect, greenIndex % 2, greenIndex / 2);
+		detectScale = 2.f;
+		detectOffsetX = (float)(greenIndex % 2);
+		detectOffsetY = (float)(greenIndex / 2);
+	}
+	else if (imageLeft.channels() == 3)
+		extractChannel(imageLeft, imageDetect, 1);
+	else
+		imageDetect = imageLeft;
+	if (imageDetect.depth() != CV_8U)
+	{
+		double minVal, maxVal;
+		minMaxLoc(imageDetect, &minVal, &maxVal);
+		imageDetect.convertTo(imageDetect, CV_8U, 255./max(maxVal-minVal, 1.), -minVal*255./max(maxVal-minVal, 1.));
+	}
+
+	// detect the features and convert them to full resolution coordinates of the left image
+	vector<Point2f> corners, cornersRectified;
+	goodFeaturesToTrack(imageDetect, corners, maxFeatures, featureQuality, featureSpacing);
+	if ((int)corners.size() < minMatches)
+		return pointCloud;
+	for (int i=0; i<(int)corners.size(); i++)
+		corners[i] = Point2f(corners[i].x*detectScale + detectOffsetX, corners[i].y*detectScale + detectOffsetY);
+
+	// rectify only the feature points and get the (cached) maps used to rectify the patches around them
+	RectificationMaps maps;
+	if (rectify)
+	{
+		undistortPoints(corners, cornersRectified, cameraMatrix.M1, cameraMatrix.D1, cameraMatrix.R1, cameraMatrix.P1);
+		GetRectificationMaps(cameraMatrix, imageSize, maps);
+	}
+	else
+		cornersRectified = corners;
+
+	// match each feature along its row of the right image and convert the disparity to a distance
+	Mat patchLeft, stripRight, score, map1, map2;
+	const Mat &Q = cameraMatrix.Q;
+	double Q23 = Q.at<double>(2,3), Q32 = Q.at<double>(3,2), Q33 = Q.at<double>(3,3);
+	vector<float> distances;
+	distances.reserve(cornersRectified.size());
+	for (int i=0; i<(int)cornersRectified.size(); i++)
+	{
+		// the left patch is centered on the rectified feature and the right strip covers all the disparities
+		int x = cvRound(cornersRectified[i].x), y = cvRound(cornersRectified[i].y);
+		Rect patchRect(x-halfPatch, y-halfPatch, 2*halfPatch+1, 2*halfPatch+1);
+		Rect stripRect(x-maxDisparity-halfPatch, y-halfPatch, maxDisparity-minDisparity+2*halfPatch+1, 2*halfPatch+1);
+		if (patchRect.x < 0 || patchRect.y < 0 || patchRect.x+patchRect.width > imageSize.width || patchRect.y+patchRect.height > imageSize.height)
+			continue;
+		if (stripRect.x < 0)
+			continue;
+
+		// rectify (and demosaic) just the patch and the strip
+		if (rectify)
+		{
+			RectifyRegion(imageLeft, maps.map11(patchRect), maps.map12(patchRect), cfaPattern, patchLeft);
+			RectifyRegion(imageRight, maps.map21(stripRect), maps.map22(stripRect), cfaPatternRight, stripRight);
+		}
+		else
+		{
+			IdentityMaps(patchRect, map1, map2);
+			RectifyRegion(imageLeft, map1, map2, cfaPattern, patchLeft);
+			IdentityMaps(stripRect, map1, map2);
+			RectifyRegion(imageRight, map1, map2, cfaPatternRight, stripRight);
+		}
+
+		// find the best (and distinct) normalized correlation along the strip
+		matchTemplate(stripRight, patchLeft, score, TM_CCOEFF_NORMED);
+		const float *s = score.ptr<float>(0);
+		int nScores = score.cols, best = 0;
+		for (int k=1; k<nScores; k++)
+			if (s[k] > s[best])
+				best = k;
+		if (s[best] < minScore)
+			continue;
+		bool distinct = true;
+		for (int k=0; k<nScores && distinct; k++)
+			if (abs(k-best) > 2 && s[k] > s[best]-minScoreMargin)
+				distinct = false;
+		if (!distinct)
+			continue;
+
+		// refine the match to subpixel position by fitting a parabola to the scores around it
+		float subpixel = 0.f;
+		if (best > 0 && best < nScores-1)
+		{
+			float denominator = s[best-1] - 2.f*s[best] + s[best+1];
+			if (denominator < 0.f)
+				subpixel = 0.5f * (s[best-1] - s[best+1]) / denominator;
+		}
+
+		// the disparity is the distance from the feature to the matching patch center in the right image
+		double disparity = x - (stripRect.x + halfPatch + best + subpixel);
+		double w = Q32*disparity + Q33;
+		if (w <= 0.)
+			continue;
+		distances.push_back((float)(Q23/w) * waterRefractionIndex);	// correct for water density
+	}
+	if ((int)distances.size() < minMatches)
+	{
+		FrameLog() << "Only " << distances.size() << " features matched, no altitude computed" << endl;
+		return pointCloud;
+	}
+
+	// remove outliers using the median absolute deviation from the median distance
+	vector<float> deviations(distances.size());
+	size_t middle = distances.size()/2;
+	nth_element(distances.begin(), distances.begin()+middle, distances.end());
+	float median = distances[middle];
+	for (size_t i=0; i<distances.size(); i++)
+		deviations[i] = fabs(distances[i] - median);
+	nth_element(deviations.begin(), deviations.begin()+middle, deviations.end());
+	float limit = (float)(outlierMADs * 1.4826 * deviations[middle]);
+
+	// mean, min and max of the remaining distances
+	double sum = 0.;
+	int nInliers = 0;
+	pointCloud.minDistance = median;
+	pointCloud.maxDistance = median;
+	for (size_t i=0; i<distances.size(); i++)
+		if (fabs(distances[i] - median) <= limit)
+		{
+			sum += distances[i];
+			nInliers++;
+			pointCloud.minDistance = min(pointCloud.minDistance, distances[i]);
+			pointCloud.maxDistance = max(pointCloud.maxDistance, distances[i]);
+		}
+	pointCloud.meanDistance = (float)(sum / nInliers);
+	pointCloud.medianDistance = median;
+
+	return pointCloud;
+}
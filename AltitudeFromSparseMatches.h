@@ -0,0 +1,17 @@
+//===============================================================================//
+//                                                                               //
+// Header for AltitudeFromSparseMatches.cpp                                      //
+//                                                                               //
+//===============================================================================//
+
+#ifndef AltitudeFromSparseMatches_H_
+#define AltitudeFromSparseMatches_H_
+
+#include "StereoStructDefines.h"
+#include <opencv2/core/core.hpp>
+
+#include <string>
+
+PointCloud AltitudeFromSparseMatches(cv::Mat image, const CameraMatrix &cameraMatrix, bool rectify=true, std::string cfaPattern="");
+
+#endif
@@ -8,22 +8,50 @@
 //                                                                               //
 // Input:   image             Input image pair (joined left and right)           //
 //          cameraMatrix      Camera calibration matrices                        //
-//          doNotRectify      A boolean option to skip the rectification process //
-//          displayRectifiedImage Boolean option to display images as processed  //
-//          displayDisparityImage Boolean option to display images as processed  //
-//          pauseForKeystroke A boolean option to pause if image is displayed    //
+//          parameter         User-controlled parameters, of which these apply:  //
+//            doNotRectify    A boolean option to skip the rectification process //
+//            doNotSaveRectifiedImage  The rectified pair is only matched, so it //
+//                            is not needed in color or outside the calibration's//
+//                            valid regions                                      //
+//            demosaicBeforeRectify  Raw pairs are demosaiced as a whole and     //
+//                            then rectified, not demosaiced while rectifying    //
+//            matchOnGreen    A boolean option to match single channel images    //
+//            estimateDisparityRange  Option to narrow the disparity search      //
+//            sequentialFrames  Option to search near the previous frame's range //
+//            matchOverlapOnly  Option to skip matching the cropped columns      //
+//            altitudeOnly    Option to only compute the altitude (sparse match) //
+//            gateAltitude    Option to skip the full resolution work if the     //
+//                            sparse altitude is outside the altitude window     //
+//            minAltitude, maxAltitude, altitudeGateMargin  Altitude window (mm) //
+//            sgbmStripCount, sgbmStripOverlap  Match in parallel strips         //
+//            displayRectifiedImage Boolean option to display images as processed//
+//            displayDisparityImage Boolean option to display images as processed//
+//            pauseForKeystroke A boolean option to pause if image is displayed  //
+//          cfaPattern        Bayer pattern if image is a raw (CFA) image pair,  //
+//                            which is then demosaiced as part of rectification  //
+//          context           Matcher and buffers reused from frame to frame     //
 // Output:  imageRectified    A joined left-right pair of rectified images       //
+//                            (single channel if matching on green and the color //
+//                            pair is not needed)                                //
 //          pointCloud        A 3D world coordinate reconstruction in mm units   //
-//          returned value    The mean altitude of camera in mm units            //
+//                            (only the distances if computing altitude only)    //
+//          returned value    The mean altitude of camera in mm units (the       //
+//                            sparse estimate if the frame was rejected by the   //
+//                            altitude gate, 0 if there was no estimate)         //
 //                                                                               //
 // Author:                  Peter Honig, phonig@whoi.edu, April 15 2015          //
 //                                                                               //
 //===============================================================================//
 
+#include "GlobalDefines.h"
 #include "StereoStructDefines.h"
+#include "AltitudeFromStereo.h"
 #include "RectifyImage.h"
 #include "Reconstruct3dImage.h"
+#include "AltitudeFromSparseMatches.h"
 #include "DataIO.h"
+#include "demosaic.hpp"
+#include "FrameLog.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -35,18 +63,98 @@ using namespace cv;
 using namespace std;
 
 
-float AltitudeFromStereo(Mat image, CameraMatrix cameraMatrix, Mat &imageRectified, PointCloud &pointCloud,
-	bool doNotRectify, bool displayRectifiedImage, bool displayDisparityImage, bool pauseForKeystroke)
+float AltitudeFromStereo(Mat image, const CameraMatrix &cameraMatrix, Mat &imageRectified, PointCloud &pointCloud,
+	const Parameters &parameter, ReconstructionContext &context, string cfaPattern)
 {
-	// rectify the image pair
-	if (doNotRectify)
-		imageRectified = image;
-	else
-		imageRectified = RectifyImage(image, cameraMatrix, displayRectifiedImage, pauseForKeystroke);
+	// rectify the pair unless the altitude is already known (or rejected) from sparse matches
+	Mat imageMatch;
+	if (!RectifyStereoPair(image, cameraMatrix, imageRectified, imageMatch, pointCloud, parameter, cfaPattern))
+		return pointCloud.meanDistance;
 
 	// generate a point cloud
-	pointCloud = Reconstruct3dImage(imageRectified, cameraMatrix, displayDisparityImage, pauseForKeystroke);
+	pointCloud = Reconstruct3dImage(imageMatch, cameraMatrix, context, parameter, parameter.displayDisparityImage,
+		parameter.pauseForKeystroke);
 
 	// return the altitude
 	return pointCloud.meanDistance;
 }
+
+
+// The first half of AltitudeFromStereo (everything before the dense matching), which returns false (with the sparse
+// result in pointCloud) if the frame is done, i.e. only the altitude is computed or the altitude gate rejected it
+bool RectifyStereoPair(Mat image, const CameraMatrix &cameraMatrix, Mat &imageRectified, Mat &imageMatch, PointCloud &pointCloud,
+	const Parameters &parameter, string cfaPattern)
+{
+	// color is only needed if the rectified pair will be saved (or matching is done in color)
+	bool needColor = !parameter.matchOnGreen || (!parameter.doNotRectify && !parameter.doNotSaveRectifiedImage);
+	bool display = parameter.displayRectifiedImage;
+	bool pause = parameter.pauseForKeystroke;
+
+	// if only the altitude is needed, match sparse features instead of rectifying and matching the whole pair
+	if (parameter.altitudeOnly)
+	{
+		imageRectified.release();
+		pointCloud = AltitudeFromSparseMatches(image, cameraMatrix, !parameter.doNotRectify, cfaPattern);
+		return false;
+	}
+
+	// reject frames that are clearly off the bottom before any full resolution work, using the sparse estimate; it
+	// finds no altitude (0) when the features have too few matches, which can also happen in range (e.g. over sand
+	// or in turbid water), so those frames are matched as usual
+	if (parameter.gateAltitude)
+	{
+		PointCloud estimate = AltitudeFromSparseMatches(image, cameraMatrix, !parameter.doNotRectify, cfaPattern);
+		if (estimate.meanDistance == 0)
+			FrameLog() << "Sparse altitude estimate found no altitude, the altitude gate is inconclusive" << endl;
+		else if (estimate.meanDistance < parameter.minAltitude - parameter.altitudeGateMargin ||
+			estimate.meanDistance > parameter.maxAltitude + parameter.altitudeGateMargin)
+		{
+			FrameLog() << "Estimated altitude " << estimate.meanDistance << " mm is outside the altitude window" << endl;
+			imageRectified.release();
+			pointCloud = estimate;
+			return false;
+		}
+	}
+
+	// rectify the image pair (demosaicing raw images in the same pass)
+	if (cfaPattern.empty())
+	{
+		// matching on a single channel of a color image uses its green channel
+		if (!needColor && image.channels() == 3)
+		{
+			Mat imageGreen;
+			extractChannel(image, imageGreen, 1);
+			image = imageGreen;
+		}
+		if (parameter.doNotRectify)
+			imageRectified = image;
+		else
+			imageRectified = RectifyImage(image, cameraMatrix, display, pause, parameter.doNotSaveRectifiedImage);
+	}
+	else
+	{
+		if (parameter.doNotRectify)
+			imageRectified = demosaic(image, cfaPattern);
+		else if (parameter.demosaicBeforeRectify)
+		{
+			// demosaic the whole pair, then rectify it as a color pair
+			Mat imageColor = demosaic(image, cfaPattern);
+			if (!needColor)
+			{
+				Mat imageGreen;
+				extractChannel(imageColor, imageGreen, 1);
+				imageColor = imageGreen;
+			}
+			imageRectified = RectifyImage(imageColor, cameraMatrix, display, pause, parameter.doNotSaveRectifiedImage);
+		}
+		else
+			imageRectified = RectifyBayerImage(image, cameraMatrix, cfaPattern, display, pause, !needColor, parameter.doNotSaveRectifiedImage);
+	}
+
+	// get the single channel matching images from the color pair if that had to be made anyway
+	if (parameter.matchOnGreen && imageRectified.channels() == 3)
+		extractChannel(imageRectified, imageMatch, 1);
+	else
+		imageMatch = imageRectified;
+	return true;
+}
@@ -9,10 +9,15 @@
 #ifndef AltitudeFromStereo_H_
 #define AltitudeFromStereo_H_
 
+#include "GlobalDefines.h"
 #include "StereoStructDefines.h"
 #include <opencv2/core/core.hpp>
 
-float AltitudeFromStereo(cv::Mat image, CameraMatrix cameraMatrix, cv::Mat &imageRectified, PointCloud &pointCloud,
-	bool doNotRectify, bool displayRectifiedImage, bool displayDisparityImage, bool pauseForKeystroke);
+#include <string>
+
+float AltitudeFromStereo(cv::Mat image, const CameraMatrix &cameraMatrix, cv::Mat &imageRectified, PointCloud &pointCloud,
+	const Parameters &parameter, ReconstructionContext &context, std::string cfaPattern="");
+bool RectifyStereoPair(cv::Mat image, const CameraMatrix &cameraMatrix, cv::Mat &imageRectified, cv::Mat &imageMatch,
+	PointCloud &pointCloud, const Parameters &parameter, std::string cfaPattern="");
 
 #endif
\ No newline at end of file
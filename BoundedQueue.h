@@ -0,0 +1,72 @@
+//===============================================================================//
+//                                                                               //
+// A bounded queue without locks for one producer thread and one consumer        //
+// thread, used to connect the stages of the frame pipeline. A full queue makes  //
+// the producer wait (backpressure) and an empty queue makes the consumer wait.  //
+//                                                                               //
+//===============================================================================//
+
+#ifndef BoundedQueue_H_
+#define BoundedQueue_H_
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+template <typename T> class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : buffer(capacity+1), head(0), tail(0) {}
+
+	// add an item if there is room (only called by the producer thread)
+	bool TryPush(const T &item)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t next = (h + 1) % buffer.size();
+		if (next == tail.load(std::memory_order_acquire))
+			return false;
+		buffer[h] = item;
+		head.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// remove the oldest item if there is one (only called by the consumer thread)
+	bool TryPop(T &item)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		item = buffer[t];
+		buffer[t] = T();		// release what the slot holds (e.g. image data) right away
+		tail.store((t + 1) % buffer.size(), std::memory_order_release);
+		return true;
+	}
+
+	// blocking versions, which spin briefly and then sleep as a stage takes tens of milliseconds or more per frame
+	void Push(const T &item)
+	{
+		for (int spin=0; !TryPush(item); spin++)
+			Wait(spin);
+	}
+	void Pop(T &item)
+	{
+		for (int spin=0; !TryPop(item); spin++)
+			Wait(spin);
+	}
+
+private:
+	static void Wait(int spin)
+	{
+		if (spin < 64)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	std::vector<T> buffer;
+	std::atomic<size_t> head;		// next slot to write
+	std::atomic<size_t> tail;		// next slot to read
+};
+
+#endif
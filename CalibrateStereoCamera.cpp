@@ -21,6 +21,8 @@
 /* rectified results along with the computed disparity images.			*/
 
 #include "CalibrateStereoCamera.h"
+#include "StereoStructDefines.h"
+#include "DataIO.h"
 
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -236,16 +238,48 @@ void CalibrateStereoCamera(const vector<string>& imageList, Size boardSize, floa
 				  imageSize, R, T, R1, R2, P1, P2, Q,
 				  CALIB_ZERO_DISPARITY, -1.0, imageSize, &validRoi[0], &validRoi[1]);
 
-	// Save the extrinsic parameters
+	// Save the extrinsic parameters and the valid regions of the rectified images (x, y, width, height)
 	fs.open(calibrationDataDirectory + "/extrinsics.yml", CV_STORAGE_WRITE);
 	if( fs.isOpened() )
 	{
+		Mat validRoi1 = (Mat_<int>(1, 4) << validRoi[0].x, validRoi[0].y, validRoi[0].width, validRoi[0].height);
+		Mat validRoi2 = (Mat_<int>(1, 4) << validRoi[1].x, validRoi[1].y, validRoi[1].width, validRoi[1].height);
 		fs << "R" << R << "T" << T << "R1" << R1 << "R2" << R2 << "P1" << P1 << "P2" << P2 << "Q" << Q;
+		fs << "validRoi1" << validRoi1 << "validRoi2" << validRoi2;
 		fs.release();
 	}
 	else
 		cout << "Error in CalibrateStereoCamera: Can't save the intrinsic parameters" << endl;
 
+	// Precompute maps for cv::remap() used to create undistorted rectified images
+	Mat rmap[2][2];
+	initUndistortRectifyMap(cameraMatrix[0], distortionCoeffs[0], R1, P1, imageSize, CV_16SC2, rmap[0][0], rmap[0][1]);
+	initUndistortRectifyMap(cameraMatrix[1], distortionCoeffs[1], R2, P2, imageSize, CV_16SC2, rmap[1][0], rmap[1][1]);
+
+	// save the matrices and maps in a binary file that the rectification program can map directly into memory
+	CameraMatrix calibration;
+	calibration.M1 = cameraMatrix[0];
+	calibration.D1 = distortionCoeffs[0];
+	calibration.M2 = cameraMatrix[1];
+	calibration.D2 = distortionCoeffs[1];
+	calibration.R = R;
+	calibration.T = T;
+	calibration.R1 = R1;
+	calibration.R2 = R2;
+	calibration.P1 = P1;
+	calibration.P2 = P2;
+	calibration.Q = Q;
+	calibration.validRoi1 = validRoi[0];
+	calibration.validRoi2 = validRoi[1];
+	RectificationMaps maps;
+	maps.map11 = rmap[0][0];
+	maps.map12 = rmap[0][1];
+	maps.map21 = rmap[1][0];
+	maps.map22 = rmap[1][1];
+	maps.imageSize = imageSize;
+	if (!WriteRectificationFile(calibrationDataDirectory, calibration, maps))
+		cout << "Error in CalibrateStereoCamera: Can't save the rectification maps" << endl;
+
 	//------------------------------------------------------------------------------------------------------------------
 	// display rectified images
 	//------------------------------------------------------------------------------------------------------------------
@@ -254,11 +288,6 @@ void CalibrateStereoCamera(const vector<string>& imageList, Size boardSize, floa
 	if (!displayImage)
 		return;
 
-	// Precompute maps for cv::remap() used to create undistorted rectified images
-	Mat rmap[2][2];
-	initUndistortRectifyMap(cameraMatrix[0], distortionCoeffs[0], R1, P1, imageSize, CV_16SC2, rmap[0][0], rmap[0][1]);
-	initUndistortRectifyMap(cameraMatrix[1], distortionCoeffs[1], R2, P2, imageSize, CV_16SC2, rmap[1][0], rmap[1][1]);
-
 	Mat canvas;
 	double sf;
 	int w, h;
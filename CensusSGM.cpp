@@ -0,0 +1,482 @@
+//===============================================================================//
+//                                                                               //
+// A semi-global matcher (Hirschmuller) with a census transform matching cost,   //
+// used in place of cv::StereoSGBM with the same settings where they apply and   //
+// the same disparity output.                                                    //
+//                                                                               //
+// The cost of each disparity is the Hamming distance between the 9x7 census     //
+// transforms of the left and right pixels (0 to 62), which is robust to the     //
+// uneven lighting of the strobes. The path costs are 16-bit and aggregated 16   //
+// (AVX2) or 8 (SSE2) disparities at a time when the compiler targets those      //
+// instruction sets, and one at a time otherwise. GCC and Clang x86 builds that  //
+// target SSE2 also compile the AVX2 version and use it if the CPU has AVX2.     //
+//                                                                               //
+// 5 paths are aggregated in a single top-down pass that only holds one row of   //
+// costs. 4 and 8 paths also need a bottom-up pass, so the aggregated costs of   //
+// a block of rows are held until it is done; the memory budget limits the       //
+// block height, and the bottom-up paths of each block start a number of rows    //
+// below it so they are settled by the time they reach it.                       //
+//                                                                               //
+//===============================================================================//
+
+#include "CensusSGM.h"
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CENSUS_SGM_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CENSUS_SGM_SSE2
+// GCC and Clang also compile the AVX2 path steps for x86 builds that don't target AVX2, and use them if the CPU has it
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>
+#define CENSUS_SGM_AVX2_DISPATCH
+#define CENSUS_SGM_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#if defined(CENSUS_SGM_AVX2)
+#define CENSUS_SGM_TARGET_AVX2
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+typedef unsigned short ushort;
+
+static const ushort MAX_PATH_COST = 0x3fff;		// pads the ends of the disparity range (well below the 16-bit sign bit)
+static const int BLOCK_OVERLAP = 64;			// rows the bottom-up paths run before reaching a block of rows
+static const int CENSUS_RX = 4, CENSUS_RY = 3;	// 9x7 census window
+
+// the row paths and the pixel (previous row) each one continues from
+enum {PATH_UP, PATH_UP_LEFT, PATH_UP_RIGHT, PATH_DOWN, PATH_DOWN_LEFT, PATH_DOWN_RIGHT, N_ROW_PATHS};
+static const int pathDx[N_ROW_PATHS] = {0, -1, 1, 0, -1, 1};
+
+
+static inline int PopCount64(unsigned long long v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	return (int)__popcnt64(v);
+#elif defined(__GNUC__)
+	return __builtin_popcountll(v);
+#else
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+
+// 9x7 census transform: one bit per neighbor that is darker than the center pixel
+static void CensusTransform(const Mat &image, Mat &padded, Mat &census)
+{
+	copyMakeBorder(image, padded, CENSUS_RY, CENSUS_RY, CENSUS_RX, CENSUS_RX, BORDER_REPLICATE);
+	census.create(image.size(), CV_32SC2);	// 64 bits per pixel
+	const uchar *rows[2*CENSUS_RY+1];
+	for (int y=0; y<image.rows; y++)
+	{
+		for (int dy=0; dy<=2*CENSUS_RY; dy++)
+			rows[dy] = padded.ptr<uchar>(y+dy);
+		unsigned long long *c = census.ptr<unsigned long long>(y);
+		for (int x=0; x<image.cols; x++)
+		{
+			uchar center = rows[CENSUS_RY][x+CENSUS_RX];
+			unsigned long long bits = 0;
+			for (int dy=0; dy<=2*CENSUS_RY; dy++)
+			{
+				const uchar *r = rows[dy] + x;
+				for (int dx=0; dx<=2*CENSUS_RX; dx++)
+					if (dy != CENSUS_RY || dx != CENSUS_RX)
+						bits = (bits << 1) | (r[dx] < center ? 1 : 0);
+			}
+			c[x] = bits;
+		}
+	}
+}
+
+
+// one step along a path for all the disparities of a pixel, adding the result to the aggregated costs S:
+//   Lr(p,d) = C(p,d) + min(Lr(p-r,d), Lr(p-r,d-1)+P1, Lr(p-r,d+1)+P1, min Lr(p-r)+P2) - min Lr(p-r)
+// prev and cur point at disparity 0 of rows padded with MAX_PATH_COST at d=-1 and d=D, and D is a multiple of 16
+// returns min Lr(p)
+typedef ushort (*PathStepFunction)(const ushort *C, const ushort *prev, ushort prevMin, ushort *cur, ushort *S,
+	int D, ushort P1, ushort P2);
+
+#if defined(CENSUS_SGM_AVX2) || defined(CENSUS_SGM_AVX2_DISPATCH)
+CENSUS_SGM_TARGET_AVX2 static inline ushort PathStepAVX2(const ushort *C, const ushort *prev, ushort prevMin, ushort *cur,
+	ushort *S, int D, ushort P1, ushort P2)
+{
+	__m256i vP1 = _mm256_set1_epi16((short)P1);
+	__m256i vPrevMinP2 = _mm256_set1_epi16((short)(prevMin + P2));
+	__m256i vPrevMin = _mm256_set1_epi16((short)prevMin);
+	__m256i vMin = _mm256_set1_epi16((short)MAX_PATH_COST);
+	for (int d=0; d<D; d+=16)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(prev + d));
+		__m256i b = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(prev + d - 1)), vP1);
+		__m256i c = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(prev + d + 1)), vP1);
+		__m256i m = _mm256_min_epi16(_mm256_min_epi16(a, b), _mm256_min_epi16(c, vPrevMinP2));
+		__m256i L = _mm256_add_epi16(_mm256_sub_epi16(m, vPrevMin), _mm256_loadu_si256((const __m256i*)(C + d)));
+		_mm256_storeu_si256((__m256i*)(cur + d), L);
+		_mm256_storeu_si256((__m256i*)(S + d), _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(S + d)), L));
+		vMin = _mm256_min_epi16(vMin, L);
+	}
+	__m128i v = _mm_min_epi16(_mm256_castsi256_si128(vMin), _mm256_extracti128_si256(vMin, 1));
+	v = _mm_min_epi16(v, _mm_srli_si128(v, 8));
+	v = _mm_min_epi16(v, _mm_srli_si128(v, 4));
+	v = _mm_min_epi16(v, _mm_srli_si128(v, 2));
+	return (ushort)_mm_extract_epi16(v, 0);
+}
+#endif
+
+// the path step of the instruction set the compiler targets
+static inline ushort PathStep(const ushort *C, const ushort *prev, ushort prevMin, ushort *cur, ushort *S,
+	int D, ushort P1, ushort P2)
+{
+#if defined(CENSUS_SGM_AVX2)
+	return PathStepAVX2(C, prev, prevMin, cur, S, D, P1, P2);
+#elif defined(CENSUS_SGM_SSE2)
+	__m128i vP1 = _mm_set1_epi16((short)P1);
+	__m128i vPrevMinP2 = _mm_set1_epi16((short)(prevMin + P2));
+	__m128i vPrevMin = _mm_set1_epi16((short)prevMin);
+	__m128i vMin = _mm_set1_epi16((short)MAX_PATH_COST);
+	for (int d=0; d<D; d+=8)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(prev + d));
+		__m128i b = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(prev + d - 1)), vP1);
+		__m128i c = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(prev + d + 1)), vP1);
+		__m128i m = _mm_min_epi16(_mm_min_epi16(a, b), _mm_min_epi16(c, vPrevMinP2));
+		__m128i L = _mm_add_epi16(_mm_sub_epi16(m, vPrevMin), _mm_loadu_si128((const __m128i*)(C + d)));
+		_mm_storeu_si128((__m128i*)(cur + d), L);
+		_mm_storeu_si128((__m128i*)(S + d), _mm_add_epi16(_mm_loadu_si128((const __m128i*)(S + d)), L));
+		vMin = _mm_min_epi16(vMin, L);
+	}
+	vMin = _mm_min_epi16(vMin, _mm_srli_si128(vMin, 8));
+	vMin = _mm_min_epi16(vMin, _mm_srli_si128(vMin, 4));
+	vMin = _mm_min_epi16(vMin, _mm_srli_si128(vMin, 2));
+	return (ushort)_mm_extract_epi16(vMin, 0);
+#else
+	int prevMinP2 = prevMin + P2;
+	ushort curMin = MAX_PATH_COST;
+	for (int d=0; d<D; d++)
+	{
+		int m = min(min((int)prev[d], prev[d-1] + P1), min(prev[d+1] + P1, prevMinP2));
+		ushort L = (ushort)(C[d] + m - prevMin);
+		cur[d] = L;
+		S[d] = (ushort)(S[d] + L);
+		curMin = min(curMin, L);
+	}
+	return curMin;
+#endif
+}
+
+
+// advance one of the paths that come from the previous row (above or below) by a row
+template <PathStepFunction Step>
+static inline void AggregateRowPathWith(const ushort *C, const ushort *prevL, const ushort *prevMin, ushort *curL,
+	ushort *curMin, ushort *S, const ushort *zero, bool firstRow, int dx, int Wc, int D, ushort P1, ushort P2)
+{
+	int Dp = D+2;
+	for (int xc=0; xc<Wc; xc++)
+	{
+		// paths start (with Lr = C) at the first row and at the left and right edges
+		int xp = xc + dx;
+		bool start = firstRow || xp < 0 || xp >= Wc;
+		const ushort *prev = start ? zero+1 : prevL + xp*Dp + 1;
+		ushort pm = start ? 0 : prevMin[xp];
+		curMin[xc] = Step(C + xc*D, prev, pm, curL + xc*Dp + 1, S + xc*D, D, P1, P2);
+	}
+}
+
+
+// aggregate the left-to-right or right-to-left path of a row (pixelL holds two padded pixels)
+template <PathStepFunction Step>
+static inline void AggregateRowHorizontalWith(const ushort *C, ushort *pixelL, ushort *S, const ushort *zero,
+	bool leftToRight, int Wc, int D, ushort P1, ushort P2)
+{
+	int Dp = D+2;
+	const ushort *prev = zero+1;
+	ushort pm = 0;
+	for (int i=0; i<Wc; i++)
+	{
+		int xc = leftToRight ? i : Wc-1-i;
+		ushort *cur = pixelL + (i&1)*Dp + 1;
+		pm = Step(C + xc*D, prev, pm, cur, S + xc*D, D, P1, P2);
+		prev = cur;
+	}
+}
+
+
+#if defined(CENSUS_SGM_AVX2_DISPATCH)
+// the row aggregation compiled for AVX2 (flatten inlines the path steps, which can't be inlined into code
+// compiled for the default target)
+__attribute__((target("avx2"), flatten)) static void AggregateRowPathAVX2(const ushort *C, const ushort *prevL,
+	const ushort *prevMin, ushort *curL, ushort *curMin, ushort *S, const ushort *zero, bool firstRow, int dx, int Wc,
+	int D, ushort P1, ushort P2)
+{
+	AggregateRowPathWith<PathStepAVX2>(C, prevL, prevMin, curL, curMin, S, zero, firstRow, dx, Wc, D, P1, P2);
+}
+
+__attribute__((target("avx2"), flatten)) static void AggregateRowHorizontalAVX2(const ushort *C, ushort *pixelL,
+	ushort *S, const ushort *zero, bool leftToRight, int Wc, int D, ushort P1, ushort P2)
+{
+	AggregateRowHorizontalWith<PathStepAVX2>(C, pixelL, S, zero, leftToRight, Wc, D, P1, P2);
+}
+
+// whether the CPU running the program has AVX2
+static bool CpuHasAVX2()
+{
+	static const bool hasAVX2 = __builtin_cpu_supports("avx2") != 0;
+	return hasAVX2;
+}
+#endif
+
+
+// the row aggregation of the best instruction set the compiler and CPU both support
+static void AggregateRowPath(const ushort *C, const ushort *prevL, const ushort *prevMin, ushort *curL, ushort *curMin,
+	ushort *S, const ushort *zero, bool firstRow, int dx, int Wc, int D, ushort P1, ushort P2)
+{
+#if defined(CENSUS_SGM_AVX2_DISPATCH)
+	if (CpuHasAVX2())
+	{
+		AggregateRowPathAVX2(C, prevL, prevMin, curL, curMin, S, zero, firstRow, dx, Wc, D, P1, P2);
+		return;
+	}
+#endif
+	AggregateRowPathWith<PathStep>(C, prevL, prevMin, curL, curMin, S, zero, firstRow, dx, Wc, D, P1, P2);
+}
+
+static void AggregateRowHorizontal(const ushort *C, ushort *pixelL, ushort *S, const ushort *zero, bool leftToRight,
+	int Wc, int D, ushort P1, ushort P2)
+{
+#if defined(CENSUS_SGM_AVX2_DISPATCH)
+	if (CpuHasAVX2())
+	{
+		AggregateRowHorizontalAVX2(C, pixelL, S, zero, leftToRight, Wc, D, P1, P2);
+		return;
+	}
+#endif
+	AggregateRowHorizontalWith<PathStep>(C, pixelL, S, zero, leftToRight, Wc, D, P1, P2);
+}
+
+
+CensusSGM::CensusSGM() : minDisparity(0), numberOfDisparities(64), P1(10), P2(120), uniquenessRatio(10), disp12MaxDiff(1),
+	speckleWindowSize(0), speckleRange(0), pathCount(8), memoryBudgetMB(256), width(0), height(0), D(0), x0(0), Wc(0)
+{
+}
+
+
+// census costs of all the disparities of the matchable pixels of a row
+void CensusSGM::ComputeCostRow(int y)
+{
+	const unsigned long long *cl = censusLeft.ptr<unsigned long long>(y);
+	const unsigned long long *cr = censusRight.ptr<unsigned long long>(y);
+	for (int xc=0; xc<Wc; xc++)
+	{
+		int x = x0 + xc;
+		unsigned long long c = cl[x];
+		const unsigned long long *r = cr + x - minDisparity;
+		ushort *C = &cost[xc*D];
+		for (int d=0; d<D; d++)
+			C[d] = (ushort)PopCount64(c ^ r[-d]);
+	}
+}
+
+
+// winner-take-all disparities of a row with the uniqueness and left-right checks and subpixel refinement
+// (as done by cv::StereoSGBM)
+void CensusSGM::SelectDisparityRow(const ushort *S, short *disparityRow)
+{
+	bool checkLeftRight = disp12MaxDiff >= 0;
+	if (checkLeftRight)
+	{
+		disparity2Cost.assign(width, (ushort)0xffff);
+		disparity2.assign(width, (short)(minDisparity-1));
+	}
+
+	for (int xc=Wc-1; xc>=0; xc--)
+	{
+		const ushort *Sp = S + xc*D;
+		int minS = Sp[0], best = 0, d;
+		for (d=1; d<D; d++)
+			if (Sp[d] < minS)
+			{
+				minS = Sp[d];
+				best = d;
+			}
+		for (d=0; d<D; d++)
+			if (Sp[d]*(100 - uniquenessRatio) < minS*100 && abs(best - d) > 1)
+				break;
+		if (d < D)
+			continue;
+
+		int x = x0 + xc;
+		if (checkLeftRight)
+		{
+			int x2 = x - minDisparity - best;
+			if (disparity2Cost[x2] > minS)
+			{
+				disparity2Cost[x2] = (ushort)minS;
+				disparity2[x2] = (short)(best + minDisparity);
+			}
+		}
+
+		if (best > 0 && best < D-1)
+		{
+			int denom2 = max(Sp[best-1] + Sp[best+1] - 2*Sp[best], 1);
+			d = best*16 + ((Sp[best-1] - Sp[best+1])*16 + denom2) / (denom2*2);
+		}
+		else
+			d = best*16;
+		disparityRow[x] = (short)(d + minDisparity*16);
+	}
+
+	if (checkLeftRight)
+	{
+		int invalid = (minDisparity-1)*16;
+		for (int x=x0; x<width; x++)
+		{
+			int d1 = disparityRow[x];
+			if (d1 == invalid)
+				continue;
+			int _d = d1 >> 4, d_ = (d1 + 15) >> 4;
+			int _x = x - _d, x_ = x - d_;
+			if (0 <= _x && _x < width && disparity2[_x] >= minDisparity && abs(disparity2[_x] - _d) > disp12MaxDiff &&
+				0 <= x_ && x_ < width && disparity2[x_] >= minDisparity && abs(disparity2[x_] - d_) > disp12MaxDiff)
+				disparityRow[x] = (short)invalid;
+		}
+	}
+}
+
+
+void CensusSGM::operator()(const Mat &left, const Mat &right, Mat &disparity)
+{
+	CV_Assert(left.size() == right.size() && left.type() == right.type() && left.depth() == CV_8U);
+	CV_Assert(minDisparity >= 0 && numberOfDisparities > 0 && numberOfDisparities % 16 == 0);
+	CV_Assert(pathCount == 4 || pathCount == 5 || pathCount == 8);
+
+	// only pixels right of the search range can match, as with cv::StereoSGBM
+	width = left.cols;
+	height = left.rows;
+	D = numberOfDisparities;
+	x0 = min(width, minDisparity + D);
+	Wc = width - x0;
+	int invalid = (minDisparity-1)*16;
+	disparity.create(left.size(), CV_16S);
+	disparity = Scalar::all(invalid);
+	if (Wc <= 0)
+		return;
+
+	// census transforms of both images (of the intensity if in color)
+	if (left.channels() == 3)
+	{
+		cvtColor(left, gray, CV_BGR2GRAY);
+		CensusTransform(gray, padded, censusLeft);
+		cvtColor(right, gray, CV_BGR2GRAY);
+		CensusTransform(gray, padded, censusRight);
+	}
+	else
+	{
+		CensusTransform(left, padded, censusLeft);
+		CensusTransform(right, padded, censusRight);
+	}
+
+	// the paths of each pass (5 paths have no bottom-up pass)
+	vector<int> forwardPaths, backwardPaths;
+	forwardPaths.push_back(PATH_UP);
+	if (pathCount != 4)
+	{
+		forwardPaths.push_back(PATH_UP_LEFT);
+		forwardPaths.push_back(PATH_UP_RIGHT);
+	}
+	if (pathCount != 5)
+		backwardPaths.push_back(PATH_DOWN);
+	if (pathCount == 8)
+	{
+		backwardPaths.push_back(PATH_DOWN_LEFT);
+		backwardPaths.push_back(PATH_DOWN_RIGHT);
+	}
+
+	// rows of aggregated costs held at once (one without a bottom-up pass, otherwise as many as fit the budget)
+	size_t rowBytes = (size_t)Wc * D * sizeof(ushort);
+	int blockRows = height;
+	if (backwardPaths.empty())
+		blockRows = 1;
+	else if (memoryBudgetMB > 0)
+		blockRows = (int)max((size_t)1, min((size_t)height, ((size_t)memoryBudgetMB << 20) / rowBytes));
+
+	// two padded rows for each row path, two padded pixels for the horizontal paths and a padded row of zeros
+	int Dp = D+2;
+	cost.resize((size_t)Wc*D);
+	aggregated.resize((size_t)blockRows*Wc*D);
+	scratch.resize((size_t)Wc*D);
+	pathBuffer.assign((size_t)N_ROW_PATHS*2*Wc*Dp + 3*Dp, MAX_PATH_COST);
+	pathMin.resize((size_t)N_ROW_PATHS*2*Wc);
+	ushort *pixelL = &pathBuffer[(size_t)N_ROW_PATHS*2*Wc*Dp];
+	ushort *zero = pixelL + 2*Dp;
+	fill(zero+1, zero+1+D, (ushort)0);
+	ushort p1 = (ushort)P1, p2 = (ushort)P2;
+
+	int forwardParity = 0;
+	for (int blockStart=0; blockStart<height; blockStart+=blockRows)
+	{
+		int blockEnd = min(height, blockStart+blockRows);
+
+		// top-down pass: the paths from above continue across blocks, the horizontal paths are within the row
+		for (int y=blockStart; y<blockEnd; y++)
+		{
+			ushort *S = &aggregated[(size_t)(y-blockStart)*Wc*D];
+			fill(S, S+(size_t)Wc*D, (ushort)0);
+			ComputeCostRow(y);
+			for (size_t i=0; i<forwardPaths.size(); i++)
+			{
+				int k = forwardPaths[i];
+				size_t prev = (size_t)(2*k + forwardParity), cur = (size_t)(2*k + 1 - forwardParity);
+				AggregateRowPath(&cost[0], &pathBuffer[prev*Wc*Dp], &pathMin[prev*Wc], &pathBuffer[cur*Wc*Dp], &pathMin[cur*Wc],
+					S, zero, y == 0, pathDx[k], Wc, D, p1, p2);
+			}
+			forwardParity = 1 - forwardParity;
+			AggregateRowHorizontal(&cost[0], pixelL, S, zero, true, Wc, D, p1, p2);
+			AggregateRowHorizontal(&cost[0], pixelL, S, zero, false, Wc, D, p1, p2);
+			if (backwardPaths.empty())
+				SelectDisparityRow(S, disparity.ptr<short>(y));
+		}
+		if (backwardPaths.empty())
+			continue;
+
+		// bottom-up pass: start below the block (the sums of the rows below it are discarded into scratch)
+		int start = blockEnd == height ? height : min(height, blockEnd + BLOCK_OVERLAP);
+		int backwardParity = 0;
+		for (int y=start-1; y>=blockStart; y--)
+		{
+			bool inBlock = y < blockEnd;
+			ushort *S = inBlock ? &aggregated[(size_t)(y-blockStart)*Wc*D] : &scratch[0];
+			ComputeCostRow(y);
+			for (size_t i=0; i<backwardPaths.size(); i++)
+			{
+				int k = backwardPaths[i];
+				size_t prev = (size_t)(2*k + backwardParity), cur = (size_t)(2*k + 1 - backwardParity);
+				AggregateRowPath(&cost[0], &pathBuffer[prev*Wc*Dp], &pathMin[prev*Wc], &pathBuffer[cur*Wc*Dp], &pathMin[cur*Wc],
+					S, zero, y == start-1, pathDx[k], Wc, D, p1, p2);
+			}
+			backwardParity = 1 - backwardParity;
+			if (inBlock)
+				SelectDisparityRow(S, disparity.ptr<short>(y));
+		}
+	}
+
+	// remove small blobs of disparities that differ from their surroundings, as cv::StereoSGBM does
+	if (speckleWindowSize > 0)
+		filterSpeckles(disparity, invalid, speckleWindowSize, 16*speckleRange, speckleBuffer);
+}
@@ -0,0 +1,45 @@
+//===============================================================================//
+//                                                                               //
+// Header for CensusSGM.cpp                                                      //
+//                                                                               //
+//===============================================================================//
+
+#ifndef CensusSGM_H_
+#define CensusSGM_H_
+
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+
+// semi-global matcher with a census transform cost, used like cv::StereoSGBM (same settings where they apply
+// and the same disparity output, pixel disparities * 16 with minDisparity-1 marking unmatched pixels)
+class CensusSGM
+{
+public:
+	CensusSGM();
+	void operator()(const cv::Mat &left, const cv::Mat &right, cv::Mat &disparity);
+
+	int minDisparity;			// 0 or more
+	int numberOfDisparities;	// multiple of 16
+	int P1;						// penalty for a disparity change of 1 between neighbors (costs are 0 to 62)
+	int P2;						// penalty for larger disparity changes
+	int uniquenessRatio;
+	int disp12MaxDiff;			// negative disables the left-right check
+	int speckleWindowSize;
+	int speckleRange;
+	int pathCount;				// 4, 5 (a single top-down pass) or 8 aggregation paths
+	int memoryBudgetMB;			// limit for the aggregated costs (0 for none), 4 and 8 paths only
+
+protected:
+	void ComputeCostRow(int y);
+	void SelectDisparityRow(const unsigned short *S, short *disparityRow);
+
+	int width, height, D, x0, Wc;
+	cv::Mat censusLeft, censusRight, gray, padded, speckleBuffer;
+	std::vector<unsigned short> cost, aggregated, scratch;
+	std::vector<unsigned short> pathBuffer, pathMin;
+	std::vector<unsigned short> disparity2Cost;
+	std::vector<short> disparity2;
+};
+
+#endif
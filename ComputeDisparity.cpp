@@ -0,0 +1,198 @@
+//===============================================================================//
+//                                                                               //
+// This function computes the disparity map of a rectified stereo pair with the  //
+// selected matcher of the context (StereoSGBM or the census SGM), either over   //
+// the whole frame or split into horizontal strips that are matched              //
+// concurrently and then stitched together. Either matcher runs on a single      //
+// core, so this uses the other cores for a single frame.                        //
+//                                                                               //
+// Each strip is matched with extra overlap rows above and below it, so the      //
+// vertical and diagonal aggregation paths of the rows that are kept start well  //
+// outside of them, and only the rows of the strip itself are kept.              //
+//                                                                               //
+// Input:   imageLeft         Left rectified image                               //
+//          imageRight        Right rectified image                              //
+//          context           Matchers (with their settings) and buffers reused  //
+//                            from frame to frame                                //
+//          parameter         User-controlled parameters, of which these apply:  //
+//            stereoMatcher   "sgbm" (default) or "census"                       //
+//            sgmPathCount, sgmMemoryBudgetMB  Census matcher paths and memory   //
+//            sgbmStripCount  Number of strips (1 matches the whole frame, 0     //
+//                            uses one strip per core)                           //
+//            sgbmStripOverlap  Rows added above and below each strip            //
+//            benchmarkMatcher  Option to also match the whole frame and print   //
+//                            the timing and agreement of the two                //
+// Output:  disparity         Disparity map (CV_16S, pixel disparities * 16)     //
+//                                                                               //
+//===============================================================================//
+
+#include "ComputeDisparity.h"
+#include "FrameLog.h"
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+
+using namespace cv;
+using namespace std;
+
+// copy the settings (but not the buffers, which would then be shared) of one matcher to another
+static void CopyMatcherSettings(const CensusSGM &from, CensusSGM &to)
+{
+	to.minDisparity = from.minDisparity;
+	to.numberOfDisparities = from.numberOfDisparities;
+	to.P1 = from.P1;
+	to.P2 = from.P2;
+	to.uniquenessRatio = from.uniquenessRatio;
+	to.disp12MaxDiff = from.disp12MaxDiff;
+	to.speckleWindowSize = from.speckleWindowSize;
+	to.speckleRange = from.speckleRange;
+	to.pathCount = from.pathCount;
+	to.memoryBudgetMB = from.memoryBudgetMB;
+}
+
+static void CopyMatcherSettings(const StereoSGBM &from, StereoSGBM &to)
+{
+	to.minDisparity = from.minDisparity;
+	to.numberOfDisparities = from.numberOfDisparities;
+	to.SADWindowSize = from.SADWindowSize;
+	to.preFilterCap = from.preFilterCap;
+	to.uniquenessRatio = from.uniquenessRatio;
+	to.P1 = from.P1;
+	to.P2 = from.P2;
+	to.speckleWindowSize = from.speckleWindowSize;
+	to.speckleRange = from.speckleRange;
+	to.disp12MaxDiff = from.disp12MaxDiff;
+	to.fullDP = from.fullDP;
+}
+
+// matches the strips of a range, each with its own matcher and disparity buffer
+class StripMatchInvoker : public ParallelLoopBody
+{
+public:
+	StripMatchInvoker(const Mat &_imageLeft, const Mat &_imageRight, Mat &_disparity, ReconstructionContext &_context,
+		bool _useCensus, int _stripCount, int _stripOverlap) : imageLeft(_imageLeft), imageRight(_imageRight),
+		disparity(_disparity), context(_context), useCensus(_useCensus), stripCount(_stripCount), stripOverlap(_stripOverlap) {}
+
+	void operator()(const Range &range) const
+	{
+		int rows = imageLeft.rows;
+		for (int i=range.start; i<range.end; i++)
+		{
+			// rows of the strip and of the strip plus its overlap
+			int y0 = rows*i/stripCount, y1 = rows*(i+1)/stripCount;
+			int yOverlap0 = max(0, y0-stripOverlap), yOverlap1 = min(rows, y1+stripOverlap);
+
+			// match the strip with its overlap and keep the rows of the strip itself
+			Mat &stripDisparity = context.stripDisparities[i];
+			Mat stripLeft = imageLeft.rowRange(yOverlap0, yOverlap1), stripRight = imageRight.rowRange(yOverlap0, yOverlap1);
+			if (useCensus)
+				context.stripCensus[i](stripLeft, stripRight, stripDisparity);
+			else
+				context.stripMatchers[i](stripLeft, stripRight, stripDisparity);
+			Mat disparityRows = disparity.rowRange(y0, y1);
+			stripDisparity.rowRange(y0-yOverlap0, y1-yOverlap0).copyTo(disparityRows);
+		}
+	}
+
+private:
+	const Mat &imageLeft;
+	const Mat &imageRight;
+	Mat &disparity;
+	ReconstructionContext &context;
+	bool useCensus;
+	int stripCount;
+	int stripOverlap;
+};
+
+
+// match the whole frame with the selected matcher
+static void MatchFrame(const Mat &imageLeft, const Mat &imageRight, Mat &disparity, ReconstructionContext &context, bool useCensus)
+{
+	if (useCensus)
+		context.census(imageLeft, imageRight, disparity);
+	else
+		context.sgbm(imageLeft, imageRight, disparity);
+}
+
+
+void ComputeDisparity(Mat imageLeft, Mat imageRight, Mat &disparity, ReconstructionContext &context, const Parameters &parameter)
+{
+	int stripCount = parameter.sgbmStripCount, stripOverlap = parameter.sgbmStripOverlap;
+	bool benchmark = parameter.benchmarkMatcher;
+
+	// the census matcher searches the range set for StereoSGBM with the same checks (but its own penalties)
+	bool useCensus = parameter.stereoMatcher == "census";
+	if (useCensus)
+	{
+		context.census.minDisparity = context.sgbm.minDisparity;
+		context.census.numberOfDisparities = context.sgbm.numberOfDisparities;
+		context.census.uniquenessRatio = context.sgbm.uniquenessRatio;
+		context.census.disp12MaxDiff = context.sgbm.disp12MaxDiff;
+		context.census.speckleWindowSize = context.sgbm.speckleWindowSize;
+		context.census.speckleRange = context.sgbm.speckleRange;
+		context.census.pathCount = parameter.sgmPathCount;
+		context.census.memoryBudgetMB = parameter.sgmMemoryBudgetMB;
+	}
+
+	// one strip per core if not specified, and strips at least as tall as the overlap
+	if (stripCount <= 0)
+		stripCount = getNumberOfCPUs();
+	stripCount = max(1, min(stripCount, imageLeft.rows / max(stripOverlap, 16)));
+
+	// match the whole frame serially
+	int64 startTime = getTickCount();
+	if (stripCount == 1)
+	{
+		MatchFrame(imageLeft, imageRight, disparity, context, useCensus);
+		if (benchmark)
+			FrameLog() << "Disparity computed in " << (getTickCount()-startTime)*1000./getTickFrequency() << " ms" << endl;
+		return;
+	}
+
+	// match the strips concurrently, each with its own copy of the matcher (and its own buffers, the census
+	// matcher's budget being shared between them)
+	context.stripDisparities.resize(stripCount);
+	if (useCensus)
+	{
+		context.stripCensus.resize(stripCount);
+		for (int i=0; i<stripCount; i++)
+		{
+			CopyMatcherSettings(context.census, context.stripCensus[i]);
+			context.stripCensus[i].memoryBudgetMB = (context.census.memoryBudgetMB + stripCount - 1) / stripCount;
+		}
+	}
+	else
+	{
+		context.stripMatchers.resize(stripCount);
+		for (int i=0; i<stripCount; i++)
+			CopyMatcherSettings(context.sgbm, context.stripMatchers[i]);
+	}
+	disparity.create(imageLeft.size(), CV_16S);
+	parallel_for_(Range(0, stripCount), StripMatchInvoker(imageLeft, imageRight, disparity, context, useCensus, stripCount, stripOverlap),
+		stripCount);
+
+	// compare with the whole frame matcher (a pixel agrees if both are invalid or both are within one disparity)
+	if (benchmark)
+	{
+		double stripTime = (getTickCount()-startTime)*1000./getTickFrequency();
+		startTime = getTickCount();
+		MatchFrame(imageLeft, imageRight, context.disparityReference, context, useCensus);
+		double serialTime = (getTickCount()-startTime)*1000./getTickFrequency();
+		int invalid = (context.sgbm.minDisparity-1)*16;
+		int nAgree = 0;
+		for (int y=0; y<disparity.rows; y++)
+		{
+			const short *d = disparity.ptr<short>(y), *r = context.disparityReference.ptr<short>(y);
+			for (int x=0; x<disparity.cols; x++)
+				if ((d[x] <= invalid && r[x] <= invalid) || (d[x] > invalid && r[x] > invalid && abs(d[x]-r[x]) <= 16))
+					nAgree++;
+		}
+		FrameLog() << "Disparity computed in " << stripTime << " ms with " << stripCount << " strips, " << serialTime
+			<< " ms as one frame, " << 100.*nAgree/disparity.total() << "% of pixels agree" << endl;
+	}
+}
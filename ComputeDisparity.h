@@ -0,0 +1,16 @@
+//===============================================================================//
+//                                                                               //
+// Header for ComputeDisparity.cpp                                               //
+//                                                                               //
+//===============================================================================//
+
+#ifndef ComputeDisparity_H_
+#define ComputeDisparity_H_
+
+#include "GlobalDefines.h"
+#include "StereoStructDefines.h"
+#include <opencv2/core/core.hpp>
+
+void ComputeDisparity(cv::Mat imageLeft, cv::Mat imageRight, cv::Mat &disparity, ReconstructionContext &context, const Parameters &parameter);
+
+#endif
@@ -16,10 +16,54 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <cstddef>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace cv;
 using namespace std;
 
+// layout of the binary rectification file (all offsets relative to the start of the file)
+static const char rectificationFileMagic[8] = {'S','T','R','E','C','T','0','2'};
+static const char rectificationFileMagicNoRoi[8] = {'S','T','R','E','C','T','0','1'};	// earlier files without the valid regions
+static const int rectificationFileMatrixCount = 15;
+static const size_t rectificationFileAlignment = 64;
+
+struct RectificationFileEntry
+{
+	int type;
+	int rows;
+	int cols;
+	int reserved;
+	long long offset;
+} ;
+
+struct RectificationFileHeader
+{
+	char magic[8];
+	int width;
+	int height;
+	int nMatrices;
+	int reserved;
+	RectificationFileEntry entry[rectificationFileMatrixCount];
+	int validRoi[2][4];		// x, y, width and height of the valid regions of the rectified left and right images
+} ;
+
+// a valid region saved as a 1x4 integer matrix (x, y, width, height), or an empty region if not saved
+static Rect RegionFromMatrix(const Mat &matrix)
+{
+	if (matrix.total() != 4 || matrix.depth() != CV_32S)
+		return Rect();
+	const int *r = matrix.ptr<int>(0);
+	return Rect(r[0], r[1], r[2], r[3]);
+}
+
 bool ReadCameraMatrices(string calibrationDataDirectory, CameraMatrix &cameraMatrix)
 {
 	// get the intrinsic and extrinsic matrices from previous calibration
@@ -61,6 +105,11 @@ bool ReadExtrinsicMatrices(string calibrationDataDirectory, CameraMatrix &camera
 		fs["P1"] >> cameraMatrix.P1;
 		fs["P2"] >> cameraMatrix.P2;
 		fs["Q"] >> cameraMatrix.Q;
+		Mat validRoi;
+		fs["validRoi1"] >> validRoi;
+		cameraMatrix.validRoi1 = RegionFromMatrix(validRoi);
+		fs["validRoi2"] >> validRoi;
+		cameraMatrix.validRoi2 = RegionFromMatrix(validRoi);
 		fs.release();
 		return true;
 	}
@@ -69,6 +118,212 @@ bool ReadExtrinsicMatrices(string calibrationDataDirectory, CameraMatrix &camera
 }
 
 
+bool WriteRectificationFile(string calibrationDataDirectory, const CameraMatrix &cameraMatrix, const RectificationMaps &maps)
+{
+	// the calibration matrices followed by the fixed-point (CV_16SC2 + CV_16UC1) remap tables
+	const Mat matrices[rectificationFileMatrixCount] = {
+		cameraMatrix.M1, cameraMatrix.D1, cameraMatrix.M2, cameraMatrix.D2, cameraMatrix.R, cameraMatrix.T,
+		cameraMatrix.R1, cameraMatrix.R2, cameraMatrix.P1, cameraMatrix.P2, cameraMatrix.Q,
+		maps.map11, maps.map12, maps.map21, maps.map22};
+
+	// open a binary file for output
+	ofstream fout;
+	fout.open((calibrationDataDirectory + "/rectification.bin").c_str(), ios::binary);
+	if(!fout.good() || fout.bad())
+		return false;
+
+	// build the header, aligning every matrix so it can be used in place once mapped
+	RectificationFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, rectificationFileMagic, sizeof(header.magic));
+	header.width = maps.imageSize.width;
+	header.height = maps.imageSize.height;
+	header.nMatrices = rectificationFileMatrixCount;
+	const Rect validRoi[2] = {cameraMatrix.validRoi1, cameraMatrix.validRoi2};
+	for (int i=0; i<2; i++)
+	{
+		header.validRoi[i][0] = validRoi[i].x;
+		header.validRoi[i][1] = validRoi[i].y;
+		header.validRoi[i][2] = validRoi[i].width;
+		header.validRoi[i][3] = validRoi[i].height;
+	}
+	long long offset = sizeof(header);
+	for (int i=0; i<rectificationFileMatrixCount; i++)
+	{
+		offset = (offset + rectificationFileAlignment - 1) / rectificationFileAlignment * rectificationFileAlignment;
+		header.entry[i].type = matrices[i].type();
+		header.entry[i].rows = matrices[i].rows;
+		header.entry[i].cols = matrices[i].cols;
+		header.entry[i].offset = offset;
+		offset += (long long)matrices[i].rows * matrices[i].cols * matrices[i].elemSize();
+	}
+	fout.write((char*)&header, sizeof(header));
+
+	// write the matrix data a row at a time (matrices may not be continuous)
+	long long position = sizeof(header);
+	char padding[rectificationFileAlignment] = {0};
+	for (int i=0; i<rectificationFileMatrixCount; i++)
+	{
+		fout.write(padding, (streamsize)(header.entry[i].offset - position));
+		for (int iRow=0; iRow<matrices[i].rows; iRow++)
+			fout.write((const char*)matrices[i].ptr(iRow), matrices[i].cols * matrices[i].elemSize());
+		position = header.entry[i].offset + (long long)matrices[i].rows * matrices[i].cols * matrices[i].elemSize();
+	}
+
+	// close the file
+	bool ok = fout.good();
+	fout.close();
+	return ok;
+}
+
+
+#ifdef _WIN32
+static vector<vector<uchar> > rectificationFileBuffers;	// stands in for the mappings where there is no mmap
+#endif
+
+// the shape each matrix of a rectification file must have (M1, D1, M2, D2, R, T, R1, R2, P1, P2 and Q, then the
+// maps of both cameras), so a damaged file can't be read past the end of a matrix or give maps of the wrong size
+static bool RectificationMatrixHasValidShape(int i, int rows, int cols, int width, int height)
+{
+	switch (i)
+	{
+	case 1: case 3:			// distortion coefficients
+		return (rows == 1 || cols == 1) && rows > 0 && cols > 0;
+	case 5:					// translation
+		return (rows == 1 || cols == 1) && (long long)rows * cols == 3;
+	case 8: case 9:			// projection matrices
+		return rows == 3 && cols == 4;
+	case 10:				// reprojection matrix
+		return rows == 4 && cols == 4;
+	default:
+		if (i < 11)			// camera and rotation matrices
+			return rows == 3 && cols == 3;
+		return rows == height && cols == width;
+	}
+}
+
+// release the mapping of a rectification file that turned out not to be valid
+static void UnmapRectificationFile(const uchar *data, long long fileSize)
+{
+#ifdef _WIN32
+	rectificationFileBuffers.pop_back();
+#else
+	munmap((void*)data, (size_t)fileSize);
+#endif
+}
+
+
+bool ReadRectificationFile(string calibrationDataDirectory, CameraMatrix &cameraMatrix, RectificationMaps &maps)
+{
+	// map the whole file into memory; the mapping is kept for the life of the process
+	// because the remap tables returned below point directly into it
+	string filename = calibrationDataDirectory + "/rectification.bin";
+	const uchar *data = 0;
+	long long fileSize = 0;
+#ifdef _WIN32
+	ifstream fin(filename.c_str(), ios::binary);
+	if (!fin.good())
+		return false;
+	fin.seekg(0, ios::end);
+	fileSize = (long long)fin.tellg();
+	fin.seekg(0, ios::beg);
+	if (fileSize < (long long)offsetof(RectificationFileHeader, validRoi))
+		return false;
+	rectificationFileBuffers.push_back(vector<uchar>((size_t)fileSize));
+	fin.read((char*)&rectificationFileBuffers.back()[0], fileSize);
+	if (!fin.good())
+	{
+		rectificationFileBuffers.pop_back();
+		return false;
+	}
+	data = &rectificationFileBuffers.back()[0];
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || fileStat.st_size < (off_t)offsetof(RectificationFileHeader, validRoi))
+	{
+		close(fd);
+		return false;
+	}
+	fileSize = (long long)fileStat.st_size;
+	void *mapped = mmap(0, (size_t)fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return false;
+	data = (const uchar*)mapped;
+#endif
+
+	// validate the header (files of the earlier version end it before the valid regions) and the extent of every matrix
+	const RectificationFileHeader *header = (const RectificationFileHeader*)data;
+	bool haveValidRoi = memcmp(header->magic, rectificationFileMagic, sizeof(header->magic)) == 0;
+	long long headerSize = haveValidRoi ? (long long)sizeof(RectificationFileHeader) : (long long)offsetof(RectificationFileHeader, validRoi);
+	if (fileSize < headerSize || (!haveValidRoi && memcmp(header->magic, rectificationFileMagicNoRoi, sizeof(header->magic)) != 0) ||
+		header->nMatrices != rectificationFileMatrixCount || header->width <= 0 || header->height <= 0)
+	{
+		cout << "Error in ReadRectificationFile: " << filename << " is not a valid rectification file" << endl;
+		UnmapRectificationFile(data, fileSize);
+		return false;
+	}
+
+	// the calibration matrices are double, and the maps are the fixed-point pair of each camera at the image size
+	Mat matrices[rectificationFileMatrixCount];
+	for (int i=0; i<rectificationFileMatrixCount; i++)
+	{
+		const RectificationFileEntry &entry = header->entry[i];
+		int expectedType = i < 11 ? CV_64FC1 : (i % 2 == 1 ? CV_16SC2 : CV_16UC1);
+		if (entry.type != expectedType)
+		{
+			cout << "Error in ReadRectificationFile: " << filename << " has a matrix of the wrong type" << endl;
+			UnmapRectificationFile(data, fileSize);
+			return false;
+		}
+		long long size = (long long)entry.rows * entry.cols * CV_ELEM_SIZE(entry.type);
+		if (entry.rows < 0 || entry.cols < 0 || entry.offset < 0 || entry.offset + size > fileSize)
+		{
+			cout << "Error in ReadRectificationFile: " << filename << " is truncated" << endl;
+			UnmapRectificationFile(data, fileSize);
+			return false;
+		}
+		if (entry.offset % rectificationFileAlignment != 0)
+		{
+			cout << "Error in ReadRectificationFile: " << filename << " has a misaligned matrix" << endl;
+			UnmapRectificationFile(data, fileSize);
+			return false;
+		}
+		if (!RectificationMatrixHasValidShape(i, entry.rows, entry.cols, header->width, header->height))
+		{
+			cout << "Error in ReadRectificationFile: " << filename << " has a matrix of the wrong size" << endl;
+			UnmapRectificationFile(data, fileSize);
+			return false;
+		}
+		matrices[i] = Mat(entry.rows, entry.cols, entry.type, (void*)(data + entry.offset));
+	}
+
+	// the calibration matrices are tiny so give them their own storage, the maps stay mapped
+	cameraMatrix.M1 = matrices[0].clone();
+	cameraMatrix.D1 = matrices[1].clone();
+	cameraMatrix.M2 = matrices[2].clone();
+	cameraMatrix.D2 = matrices[3].clone();
+	cameraMatrix.R = matrices[4].clone();
+	cameraMatrix.T = matrices[5].clone();
+	cameraMatrix.R1 = matrices[6].clone();
+	cameraMatrix.R2 = matrices[7].clone();
+	cameraMatrix.P1 = matrices[8].clone();
+	cameraMatrix.P2 = matrices[9].clone();
+	cameraMatrix.Q = matrices[10].clone();
+	cameraMatrix.validRoi1 = haveValidRoi ? Rect(header->validRoi[0][0], header->validRoi[0][1], header->validRoi[0][2], header->validRoi[0][3]) : Rect();
+	cameraMatrix.validRoi2 = haveValidRoi ? Rect(header->validRoi[1][0], header->validRoi[1][1], header->validRoi[1][2], header->validRoi[1][3]) : Rect();
+	maps.map11 = matrices[11];
+	maps.map12 = matrices[12];
+	maps.map21 = matrices[13];
+	maps.map22 = matrices[14];
+	maps.imageSize = Size(header->width, header->height);
+	return true;
+}
+
+
 bool WritePointCloud(string filename, PointCloud pointCloud, Mat image, FileFormat fileFormat)
 {
 	if (fileFormat == PC_TEXT)
@@ -17,6 +17,8 @@
 bool ReadCameraMatrices(std::string calibrationDataDirectory, CameraMatrix &cameraMatrix);
 bool ReadIntrinsicMatrices(std::string calibrationDataDirectory, CameraMatrix &cameraMatrix);
 bool ReadExtrinsicMatrices(std::string calibrationDataDirectory, CameraMatrix &cameraMatrix);
+bool ReadRectificationFile(std::string calibrationDataDirectory, CameraMatrix &cameraMatrix, RectificationMaps &maps);
+bool WriteRectificationFile(std::string calibrationDataDirectory, const CameraMatrix &cameraMatrix, const RectificationMaps &maps);
 bool WritePointCloud(std::string filename, PointCloud pointCloud, cv::Mat image, FileFormat fileFormat=PC_BINARY);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,119 @@
+//===============================================================================//
+//                                                                               //
+// This function estimates the disparity range of a rectified stereo pair by     //
+// matching a reduced resolution copy of the pair (two pyramid levels down),     //
+// so that the full resolution matcher only needs to search the band of          //
+// disparities actually occupied by the scene (plus a safety margin)             //
+//                                                                               //
+// Input:   imageLeft         Left rectified image (full resolution)             //
+//          imageRight        Right rectified image (full resolution)            //
+//          maxDisparities    Full search range, which the estimate stays within //
+//          context           Matcher and buffers reused from frame to frame     //
+// Output:  minDisparity      First disparity to search at full resolution       //
+//          numberOfDisparities Number of disparities to search (multiple of 16) //
+//          meanDisparity     Optional mean of the disparities inside the range  //
+//          returned value    False if too few pixels matched at low resolution, //
+//                            in which case the outputs are left unchanged       //
+//                                                                               //
+//===============================================================================//
+
+#include "EstimateDisparityRange.h"
+
+#include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/core.hpp>
+
+#include <vector>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+
+bool EstimateDisparityRange(Mat imageLeft, Mat imageRight, int maxDisparities, int &minDisparity, int &numberOfDisparities,
+	ReconstructionContext &context, float *meanDisparity)
+{
+	int pyramidScale = 4;			// two pyrDown levels
+	int margin = 16;				// full resolution disparities added to each end of the estimated range
+	double minValidFraction = 0.05;	// fraction of low resolution pixels that must match to trust the estimate
+	double tailFraction = 0.01;		// fraction of matched pixels ignored at each end of the range (outliers)
+
+	// reduce the pair by two pyramid levels
+	pyrDown(imageLeft, context.coarseTemp);
+	pyrDown(context.coarseTemp, context.coarseLeft);
+	pyrDown(imageRight, context.coarseTemp);
+	pyrDown(context.coarseTemp, context.coarseRight);
+
+	// match at low resolution with a small window and single pass dynamic programming (fast)
+	int SADWindowSize = 3;
+	int cn = context.coarseLeft.channels();
+	int coarseDisparities = ((maxDisparities/pyramidScale + 15) / 16) * 16;
+	if (coarseDisparities >= context.coarseLeft.cols)
+		return false;
+	StereoSGBM &sgbm = context.sgbmCoarse;
+	sgbm.minDisparity = 0;
+	sgbm.numberOfDisparities = coarseDisparities;
+	sgbm.SADWindowSize = SADWindowSize;
+	sgbm.P1 =  8 * cn * SADWindowSize * SADWindowSize;
+	sgbm.P2 = 32 * cn * SADWindowSize * SADWindowSize;
+	sgbm.disp12MaxDiff = 1;
+	sgbm.preFilterCap = 0;
+	sgbm.uniquenessRatio = 10;
+	sgbm.speckleWindowSize = 25;
+	sgbm.speckleRange = 2;
+	sgbm.fullDP = false;
+	sgbm(context.coarseLeft, context.coarseRight, context.coarseDisparity);
+
+	// histogram of the valid low resolution disparities (in 1/16 pixel units, invalid pixels are negative)
+	int nBins = coarseDisparities * 16;
+	vector<int> histogram(nBins, 0);
+	int nValid = 0;
+	for (int y=0; y<context.coarseDisparity.rows; y++)
+	{
+		const short *d = context.coarseDisparity.ptr<short>(y);
+		for (int x=coarseDisparities; x<context.coarseDisparity.cols; x++)	// columns left of this never match
+			if (d[x] >= 0 && d[x] < nBins)
+			{
+				histogram[d[x]]++;
+				nValid++;
+			}
+	}
+	int nTotal = context.coarseDisparity.rows * (context.coarseDisparity.cols - coarseDisparities);
+	if (nValid < minValidFraction * nTotal)
+		return false;
+
+	// find the low and high ends of the range, ignoring the outlying tails
+	int nTail = (int)(tailFraction * nValid);
+	int low = 0, high = nBins - 1, count = 0;
+	for (low=0; low<nBins-1; low++)
+		if ((count += histogram[low]) > nTail)
+			break;
+	count = 0;
+	for (high=nBins-1; high>low; high--)
+		if ((count += histogram[high]) > nTail)
+			break;
+
+	// scale up to full resolution and widen by the margin (which also covers the low resolution quantization)
+	int first = max(0, (low * pyramidScale) / 16 - margin);
+	int last = min(maxDisparities, (high * pyramidScale + 15) / 16 + margin);
+	int count16 = min(maxDisparities, ((last - first + 15) / 16) * 16);
+	if (first + count16 > maxDisparities)
+		first = max(0, maxDisparities - count16);
+
+	// mean of the disparities without the tails, at full resolution
+	if (meanDisparity)
+	{
+		double sum = 0.;
+		count = 0;
+		for (int i=low; i<=high; i++)
+		{
+			sum += (double)i * histogram[i];
+			count += histogram[i];
+		}
+		*meanDisparity = count > 0 ? (float)(sum * pyramidScale / (16. * count)) : 0.f;
+	}
+
+	minDisparity = first;
+	numberOfDisparities = count16;
+	return true;
+}
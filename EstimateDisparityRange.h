@@ -0,0 +1,16 @@
+//===============================================================================//
+//                                                                               //
+// Header for EstimateDisparityRange.cpp                                         //
+//                                                                               //
+//===============================================================================//
+
+#ifndef EstimateDisparityRange_H_
+#define EstimateDisparityRange_H_
+
+#include "StereoStructDefines.h"
+#include <opencv2/core/core.hpp>
+
+bool EstimateDisparityRange(cv::Mat imageLeft, cv::Mat imageRight, int maxDisparities, int &minDisparity, int &numberOfDisparities,
+	ReconstructionContext &context, float *meanDisparity=0);
+
+#endif
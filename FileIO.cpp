@@ -16,6 +16,11 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 
 using namespace cv;
 using namespace std;
@@ -102,6 +107,99 @@ bool ReadTwoImageListsFromFile(string imageListFile, vector<string> &inputList,
 }
 
 
+bool ReadTwoImageListsFromFile(string imageListFile, vector<string> &inputList, vector<string> &outputList, vector<int> &frameNumbers,
+	int shardIndex, int shardCount, int firstFrame, int lastFrame)
+{
+	if (shardCount < 1 || shardIndex < 0 || shardIndex >= shardCount)
+	{
+		cout << "ERROR in function ReadTwoImageListsFromFile: Shard " << shardIndex << " of " << shardCount << " does not exist" << endl;
+		return (false);
+	}
+
+	// read the whole lists, where the frame numbers are the positions in them (counted from 0)
+	vector<string> allInputs, allOutputs;
+	if (!ReadTwoImageListsFromFile(imageListFile, allInputs, allOutputs))
+		return (false);
+
+	// keep the frames of the range (all of them if not given), and of those the contiguous block of this shard
+	int nFrames = (int)allInputs.size();
+	int first = firstFrame >= 0 ? min(firstFrame, nFrames) : 0;
+	int last = lastFrame >= 0 ? min(lastFrame, nFrames-1) : nFrames-1;
+	int nRange = max(last - first + 1, 0);
+	int shardFirst = first + (int)((long long)nRange * shardIndex / shardCount);
+	int shardLast = first + (int)((long long)nRange * (shardIndex+1) / shardCount) - 1;
+	for (int i=shardFirst; i<=shardLast; i++)
+	{
+		inputList.push_back(allInputs[i]);
+		outputList.push_back(allOutputs[i]);
+		frameNumbers.push_back(i);
+	}
+	return (!inputList.empty());
+}
+
+
+// name of the altitude log of a shard (the log itself if the list is not sharded)
+string ShardLogFileName(string logFile, int shardIndex, int shardCount)
+{
+	if (shardCount <= 1)
+		return logFile;
+	return logFile + ".shard" + toString(shardIndex) + "of" + toString(shardCount);
+}
+
+
+bool MergeShardLogs(string logFile, int shardCount)
+{
+	if (shardCount < 1)
+	{
+		cout << "ERROR in function MergeShardLogs: There must be at least one shard" << endl;
+		return (false);
+	}
+
+	// collect the records of all the shard logs by frame number (the first field), keeping one header line
+	string header;
+	map<int, string> records;
+	for (int iShard=0; iShard<shardCount; iShard++)
+	{
+		string shardFile = ShardLogFileName(logFile, iShard, shardCount);
+		ifstream fin(shardFile.c_str());
+		if (!fin.good())
+		{
+			cout << "ERROR in function MergeShardLogs: Could not open " << shardFile << endl;
+			return (false);
+		}
+		string line;
+		while (getline(fin, line))
+		{
+			if (line.empty())
+				continue;
+			if (line[0] == '#')
+			{
+				header = line;
+				continue;
+			}
+			int frameNumber;
+			istringstream lineStream(line);
+			if (lineStream >> frameNumber)
+				records[frameNumber] = line;
+		}
+	}
+
+	// write them in frame order
+	ofstream fout(logFile.c_str());
+	if (!fout.good())
+	{
+		cout << "ERROR in function MergeShardLogs: Could not open/save " << logFile << endl;
+		return (false);
+	}
+	if (!header.empty())
+		fout << header << endl;
+	for (map<int, string>::iterator it=records.begin(); it!=records.end(); ++it)
+		fout << it->second << endl;
+	cout << "Merged " << records.size() << " frames of " << shardCount << " shards into " << logFile << endl;
+	return (fout.good());
+}
+
+
 bool ReadRuntimeParameters(string filePath, Parameters &parameter)
 {
 	// open an ascii file for input
@@ -112,12 +210,39 @@ bool ReadRuntimeParameters(string filePath, Parameters &parameter)
 
 	// set default values
 	parameter.doNotRectify = false;
+	parameter.doNotSaveRectifiedImage = false;
+	parameter.demosaicBeforeRectify = false;
+	parameter.matchOnGreen = false;
+	parameter.estimateDisparityRange = false;
+	parameter.sequentialFrames = false;
+	parameter.matchOverlapOnly = false;
+	parameter.altitudeOnly = false;
+	parameter.gateAltitude = false;
+	parameter.benchmarkMatcher = false;
 	parameter.displayRectifiedImage = false;
 	parameter.displayDisparityImage = false;
 	parameter.pauseForKeystroke = false;
 	parameter.nHorizontal = 0;
 	parameter.nVertical = 0;
 	parameter.squareSize = 0;
+	parameter.minAltitude = 1000.f;
+	parameter.maxAltitude = 3500.f;
+	parameter.altitudeGateMargin = 250.f;
+	parameter.demosaicThreadCount = 0;
+	parameter.pipelineDepth = 0;
+	parameter.workerCount = 1;
+	parameter.shardIndex = 0;
+	parameter.shardCount = 1;
+	parameter.firstFrame = -1;
+	parameter.lastFrame = -1;
+	parameter.mergeShardLogs = false;
+	parameter.ingestStdin = false;
+	parameter.ingestPollInterval = 500;
+	parameter.sgbmStripCount = 1;
+	parameter.sgbmStripOverlap = 48;
+	parameter.sgmPathCount = 8;
+	parameter.sgmMemoryBudgetMB = 256;
+	parameter.stereoMatcher = "sgbm";
 
 	// read the contents of the file a line at a time
 	string line, word;
@@ -151,12 +276,54 @@ bool ReadRuntimeParameters(string filePath, Parameters &parameter)
 			if (word == "single_square_size" && haveAnotherWord)
 				{parameter.squareSize = stof(wordList.at(++iWord)); break;}
 
+			if (word == "min_altitude" && haveAnotherWord)
+				{parameter.minAltitude = stof(wordList.at(++iWord)); break;}
+
+			if (word == "max_altitude" && haveAnotherWord)
+				{parameter.maxAltitude = stof(wordList.at(++iWord)); break;}
+
+			if (word == "altitude_gate_margin" && haveAnotherWord)
+				{parameter.altitudeGateMargin = stof(wordList.at(++iWord)); break;}
+
 			if (word == "horizontal_count" && haveAnotherWord)
 				{parameter.nHorizontal = stoi(wordList.at(++iWord)); break;}
 
 			if (word == "vertical_count" && haveAnotherWord)
 				{parameter.nVertical = stoi(wordList.at(++iWord)); break;}
 
+			if (word == "demosaic_thread_count" && haveAnotherWord)
+				{parameter.demosaicThreadCount = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "pipeline_depth" && haveAnotherWord)
+				{parameter.pipelineDepth = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "shard_index" && haveAnotherWord)
+				{parameter.shardIndex = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "shard_count" && haveAnotherWord)
+				{parameter.shardCount = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "frame_range" && iWord+2 < nWords)
+				{parameter.firstFrame = stoi(wordList.at(++iWord)); parameter.lastFrame = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "ingest_poll_interval" && haveAnotherWord)
+				{parameter.ingestPollInterval = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "worker_count" && haveAnotherWord)
+				{parameter.workerCount = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "sgbm_strip_count" && haveAnotherWord)
+				{parameter.sgbmStripCount = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "sgbm_strip_overlap" && haveAnotherWord)
+				{parameter.sgbmStripOverlap = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "sgm_path_count" && haveAnotherWord)
+				{parameter.sgmPathCount = stoi(wordList.at(++iWord)); break;}
+
+			if (word == "sgm_memory_budget_mb" && haveAnotherWord)
+				{parameter.sgmMemoryBudgetMB = stoi(wordList.at(++iWord)); break;}
+
 			// commands that are followed by strings
 			if (word == "calibration_image_listfile")
 				{parameter.calibrationImageListFile = wordList.at(++iWord); break;}
@@ -167,10 +334,58 @@ bool ReadRuntimeParameters(string filePath, Parameters &parameter)
 			if (word == "rectification_image_listfile")
 				{parameter.rectificationImageListFile = wordList.at(++iWord); break;}
 
+			if (word == "altitude_log_file")
+				{parameter.altitudeLogFile = wordList.at(++iWord); break;}
+
+			if (word == "manifest_file")
+				{parameter.manifestFile = wordList.at(++iWord); break;}
+
+			if (word == "ingest_directory")
+				{parameter.ingestDirectory = wordList.at(++iWord); break;}
+
+			if (word == "output_directory")
+				{parameter.outputDirectory = wordList.at(++iWord); break;}
+
+			if (word == "stereo_matcher")
+				{parameter.stereoMatcher = wordList.at(++iWord); break;}
+
 			// commands that are switches
 			if (word == "do_not_rectify")
 				{parameter.doNotRectify = true; break;}
 
+			if (word == "do_not_save_rectified_image")
+				{parameter.doNotSaveRectifiedImage = true; break;}
+
+			if (word == "demosaic_before_rectify")
+				{parameter.demosaicBeforeRectify = true; break;}
+
+			if (word == "match_on_green")
+				{parameter.matchOnGreen = true; break;}
+
+			if (word == "estimate_disparity_range")
+				{parameter.estimateDisparityRange = true; break;}
+
+			if (word == "sequential_frames")
+				{parameter.sequentialFrames = true; break;}
+
+			if (word == "match_overlap_only")
+				{parameter.matchOverlapOnly = true; break;}
+
+			if (word == "altitude_only")
+				{parameter.altitudeOnly = true; break;}
+
+			if (word == "ingest_stdin")
+				{parameter.ingestStdin = true; break;}
+
+			if (word == "merge_shard_logs")
+				{parameter.mergeShardLogs = true; break;}
+
+			if (word == "gate_altitude")
+				{parameter.gateAltitude = true; break;}
+
+			if (word == "benchmark_matcher")
+				{parameter.benchmarkMatcher = true; break;}
+
 			if (word == "display_rectified_image")
 				{parameter.displayRectifiedImage = true; break;}
 
@@ -204,12 +419,84 @@ void ValidateRuntimeParameters(Parameters parameter, ApplicationMode application
 		cout << "ERROR: command \"vertical_count\" missing or not followed by a positive value" << endl << endl;
 
 
-	if (parameter.rectificationImageListFile.empty() && applicationMode == RECTIFY)
+	bool ingest = parameter.ingestStdin || !parameter.ingestDirectory.empty();
+	if (parameter.rectificationImageListFile.empty() && !ingest && applicationMode == RECTIFY)
 		cout << "ERROR: command \"rectification_image_listfile\" missing or not followed by valid argument" << endl << endl;
 	if (parameter.calibrationImageListFile.empty() && applicationMode == CALIBRATE)
 		cout << "ERROR: command \"calibration_image_listfile\" missing or not followed by valid argument" << endl << endl;
+	if (parameter.demosaicThreadCount < 0 && applicationMode == RECTIFY)
+		cout << "ERROR: command \"demosaic_thread_count\" must be followed by a non-negative value" << endl << endl;
+	if (parameter.pipelineDepth < 0 && applicationMode == RECTIFY)
+		cout << "ERROR: command \"pipeline_depth\" must be followed by a non-negative value" << endl << endl;
+	if (parameter.workerCount < 0 && applicationMode == RECTIFY)
+		cout << "ERROR: command \"worker_count\" must be followed by a non-negative value" << endl << endl;
+	if ((parameter.shardCount < 1 || parameter.shardIndex < 0 || parameter.shardIndex >= parameter.shardCount) && applicationMode == RECTIFY)
+		cout << "ERROR: command \"shard_index\" must be followed by a value from 0 to one less than that of \"shard_count\"" << endl << endl;
+	if (parameter.firstFrame > parameter.lastFrame && applicationMode == RECTIFY)
+		cout << "ERROR: command \"frame_range\" must be followed by a first and a last frame number (counted from 0)" << endl << endl;
+	if (parameter.mergeShardLogs && parameter.altitudeLogFile.empty() && applicationMode == RECTIFY)
+		cout << "ERROR: command \"merge_shard_logs\" needs the command \"altitude_log_file\"" << endl << endl;
+	if (parameter.sgbmStripCount < 0 && applicationMode == RECTIFY)
+		cout << "ERROR: command \"sgbm_strip_count\" must be followed by a non-negative value" << endl << endl;
+	if (parameter.sgbmStripOverlap < 0 && applicationMode == RECTIFY)
+		cout << "ERROR: command \"sgbm_strip_overlap\" must be followed by a non-negative value" << endl << endl;
+	if (parameter.stereoMatcher != "sgbm" && parameter.stereoMatcher != "census" && applicationMode == RECTIFY)
+		cout << "ERROR: command \"stereo_matcher\" must be followed by \"sgbm\" or \"census\"" << endl << endl;
+	if (parameter.sgmPathCount != 4 && parameter.sgmPathCount != 5 && parameter.sgmPathCount != 8 && applicationMode == RECTIFY)
+		cout << "ERROR: command \"sgm_path_count\" must be followed by 4, 5 or 8" << endl << endl;
+	if (parameter.sgmMemoryBudgetMB < 0 && applicationMode == RECTIFY)
+		cout << "ERROR: command \"sgm_memory_budget_mb\" must be followed by a non-negative value" << endl << endl;
+	if (parameter.minAltitude >= parameter.maxAltitude && applicationMode == RECTIFY)
+		cout << "ERROR: command \"min_altitude\" must be followed by a value below that of \"max_altitude\"" << endl << endl;
+	if (parameter.altitudeGateMargin < 0.0f && applicationMode == RECTIFY)
+		cout << "ERROR: command \"altitude_gate_margin\" must be followed by a non-negative value" << endl << endl;
 	if (parameter.calibrationDataDirectory.empty())
 		cout << "ERROR: command \"calibration_data_directory\" missing or not followed by valid argument" << endl << endl;
 
 	cout << endl << "---------------------------------------------------------------------" << endl << endl << endl;
 }
+
+
+// the ingest commands are checked separately, since a live run that goes ahead with them wrong could overwrite
+// the incoming frames (returns false if there is an error)
+bool ValidateIngestParameters(Parameters parameter)
+{
+	bool valid = true;
+	if (parameter.ingestStdin && !parameter.ingestDirectory.empty())
+		{cout << "ERROR: commands \"ingest_stdin\" and \"ingest_directory\" can't both be given" << endl << endl; valid = false;}
+	if (parameter.ingestPollInterval <= 0)
+		{cout << "ERROR: command \"ingest_poll_interval\" must be followed by a positive value" << endl << endl; valid = false;}
+	if (!parameter.ingestDirectory.empty() && parameter.outputDirectory.empty() && !parameter.altitudeOnly)
+		{cout << "ERROR: command \"ingest_directory\" needs the command \"output_directory\"" << endl << endl; valid = false;}
+	if (!parameter.ingestDirectory.empty() && !parameter.outputDirectory.empty()
+		&& CanonicalPath(parameter.outputDirectory) == CanonicalPath(parameter.ingestDirectory))
+		{cout << "ERROR: command \"output_directory\" must be followed by a directory other than that of \"ingest_directory\"" << endl << endl; valid = false;}
+	return valid;
+}
+
+
+// absolute path without "." or ".." parts, symbolic links or trailing separators, so that two names of the
+// same file compare equal (the directory part is resolved if the file does not exist yet, and the path is
+// returned as it is if neither exists)
+string CanonicalPath(string path)
+{
+	while (path.size() > 1 && (path[path.size()-1] == '/' || path[path.size()-1] == '\\'))
+		path.erase(path.size()-1);
+
+#ifdef _WIN32
+	char resolved[_MAX_PATH];
+	if (_fullpath(resolved, path.c_str(), _MAX_PATH))
+		return string(resolved);
+	return path;
+#else
+	char resolved[PATH_MAX];
+	if (realpath(path.c_str(), resolved))
+		return string(resolved);
+	size_t found = path.find_last_of("/");
+	string directory = found == string::npos ? "." : (found == 0 ? "/" : path.substr(0, found));
+	string name = found == string::npos ? path : path.substr(found+1);
+	if (realpath(directory.c_str(), resolved))
+		return string(resolved) + (string(resolved) == "/" ? "" : "/") + name;
+	return path;
+#endif
+}
@@ -17,7 +17,13 @@
 
 bool ReadImageListFromFile(std::string imageListFile, std::vector<std::string> &directoryList, std::vector<std::string> &imageList, bool split=true);
 bool ReadTwoImageListsFromFile(std::string imageListFile, std::vector<std::string> &inputList, std::vector<std::string> &outputList);
+bool ReadTwoImageListsFromFile(std::string imageListFile, std::vector<std::string> &inputList, std::vector<std::string> &outputList,
+	std::vector<int> &frameNumbers, int shardIndex, int shardCount, int firstFrame=-1, int lastFrame=-1);
+std::string ShardLogFileName(std::string logFile, int shardIndex, int shardCount);
+bool MergeShardLogs(std::string logFile, int shardCount);
+std::string CanonicalPath(std::string path);
 bool ReadRuntimeParameters(std::string filePath, Parameters &parameter);
 void ValidateRuntimeParameters(Parameters parameter, ApplicationMode applicationMode);
+bool ValidateIngestParameters(Parameters parameter);
 
 #endif
\ No newline at end of file
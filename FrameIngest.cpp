@@ -0,0 +1,143 @@
+//===============================================================================//
+//                                                                               //
+// This class supplies the stereo frames of a live run (e.g. during a dive) as   //
+// they arrive, so they are processed without restarting the program.            //
+//                                                                               //
+// In a watched directory, a new image file is only returned once it is fully    //
+// written, that is once its size is the same at two checks of the directory a   //
+// poll interval apart (the directory is checked by listing it, which works the  //
+// same on every system). Files are returned in name order, each only once.      //
+//                                                                               //
+// Otherwise each line of stdin names a frame, either as an input file or as an  //
+// input and output file separated by a comma like the image list.               //
+//                                                                               //
+// The rectified image of a frame without an output file goes to the output      //
+// directory, with the name of the input file, or next to the input file with    //
+// "_rectified" added to its name if there is no output directory.               //
+//                                                                               //
+// Input:   parameter         User-controlled parameters, of which these apply:  //
+//            ingestDirectory       Watched directory (stdin if empty)           //
+//            ingestPollInterval    ms between checks of the directory           //
+//            outputDirectory       Directory of the rectified images            //
+//                                                                               //
+//===============================================================================//
+
+#include "FrameIngest.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <cctype>
+
+using namespace cv;
+using namespace std;
+
+// size of a file (-1 if it can't be opened, e.g. while it is being created)
+static long long FileSize(const string &filename)
+{
+	ifstream fin(filename.c_str(), ios::binary | ios::ate);
+	if (!fin.good())
+		return -1;
+	return (long long)fin.tellg();
+}
+
+// true for the image file types the frames are saved as
+static bool IsImageFile(const string &filename)
+{
+	size_t found = filename.find_last_of(".");
+	if (found == string::npos)
+		return false;
+	string extension = filename.substr(found+1);
+	transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension == "tif" || extension == "tiff" || extension == "png" || extension == "jpg" || extension == "jpeg"
+		|| extension == "bmp" || extension == "pgm" || extension == "ppm";
+}
+
+
+FrameIngest::FrameIngest(const Parameters &parameter) : ingestDirectory(parameter.ingestDirectory),
+	outputDirectory(parameter.outputDirectory), pollInterval(max(parameter.ingestPollInterval, 1))
+{
+	if (!ingestDirectory.empty())
+		cout << "Watching " << ingestDirectory << " for new frames" << endl;
+	else
+		cout << "Reading frames from stdin" << endl;
+}
+
+
+bool FrameIngest::Next(string &inputFile, string &outputFile)
+{
+	// read the next frame named on stdin
+	if (ingestDirectory.empty())
+	{
+		string line;
+		while (getline(cin, line))
+		{
+			line.erase(line.find_last_not_of(" \t\r\n") + 1);
+			if (line.empty())
+				continue;
+			size_t comma = line.find_last_of(",");
+			inputFile = comma == string::npos ? line : line.substr(0, comma);
+			outputFile = comma == string::npos ? OutputFile(inputFile) : line.substr(comma+1);
+			return true;
+		}
+		return false;
+	}
+
+	// or wait for the next fully written file of the directory
+	while (readyFiles.empty())
+	{
+		PollDirectory();
+		if (readyFiles.empty())
+			this_thread::sleep_for(chrono::milliseconds(pollInterval));
+	}
+	inputFile = readyFiles.front();
+	readyFiles.pop_front();
+	outputFile = OutputFile(inputFile);
+	return true;
+}
+
+
+void FrameIngest::PollDirectory()
+{
+	vector<string> files;
+	glob(ingestDirectory + "/*", files, false);
+	sort(files.begin(), files.end());
+	for (size_t i=0; i<files.size(); i++)
+	{
+		if (!IsImageFile(files[i]) || returnedFiles.count(files[i]))
+			continue;
+
+		// a file is ready once its size stops changing between checks
+		long long size = FileSize(files[i]);
+		map<string, long long>::iterator pending = pendingSizes.find(files[i]);
+		if (pending != pendingSizes.end() && size > 0 && size == pending->second)
+		{
+			readyFiles.push_back(files[i]);
+			returnedFiles.insert(files[i]);
+			pendingSizes.erase(pending);
+		}
+		else
+			pendingSizes[files[i]] = size;
+	}
+}
+
+
+string FrameIngest::OutputFile(const string &inputFile) const
+{
+	if (outputDirectory.empty())
+	{
+		size_t separator = inputFile.find_last_of("/\\"), found = inputFile.find_last_of(".");
+		if (found == string::npos || (separator != string::npos && found < separator))
+			return inputFile + "_rectified";
+		return inputFile.substr(0, found) + "_rectified" + inputFile.substr(found);
+	}
+	size_t found = inputFile.find_last_of("/\\");
+	string name = found == string::npos ? inputFile : inputFile.substr(found+1);
+	return outputDirectory + "/" + name;
+}
@@ -0,0 +1,38 @@
+//===============================================================================//
+//                                                                               //
+// Header for FrameIngest.cpp                                                    //
+//                                                                               //
+//===============================================================================//
+
+#ifndef FrameIngest_H_
+#define FrameIngest_H_
+
+#include "GlobalDefines.h"
+
+#include <string>
+#include <deque>
+#include <map>
+#include <set>
+
+// the stereo frames that arrive while running, either written to a directory or named on stdin
+class FrameIngest
+{
+public:
+	explicit FrameIngest(const Parameters &parameter);
+
+	// wait for the next frame, returning false when no more frames will arrive (the end of stdin)
+	bool Next(std::string &inputFile, std::string &outputFile);
+
+private:
+	void PollDirectory();
+	std::string OutputFile(const std::string &inputFile) const;
+
+	std::string ingestDirectory;				// watched directory (empty to read stdin)
+	std::string outputDirectory;
+	int pollInterval;							// ms between checks of the directory
+	std::deque<std::string> readyFiles;			// fully written files not yet returned, in name order
+	std::map<std::string, long long> pendingSizes;	// sizes of new files at the last check, until they stop changing
+	std::set<std::string> returnedFiles;
+};
+
+#endif
@@ -0,0 +1,34 @@
+//===============================================================================//
+//                                                                               //
+// The log lines about a frame are written to FrameLog() instead of cout, so     //
+// that when several frames are processed at once each thread can capture the    //
+// lines of its frame and print them as one group.                               //
+//                                                                               //
+//===============================================================================//
+
+#include "FrameLog.h"
+
+#include <iostream>
+
+using namespace std;
+
+static thread_local ostream *frameLogStream = 0;
+
+
+ostream &FrameLog()
+{
+	return frameLogStream ? *frameLogStream : cout;
+}
+
+
+FrameLogCapture::FrameLogCapture(string &log) : log(log), previous(frameLogStream)
+{
+	frameLogStream = &stream;
+}
+
+
+FrameLogCapture::~FrameLogCapture()
+{
+	frameLogStream = previous;
+	log += stream.str();
+}
@@ -0,0 +1,30 @@
+//===============================================================================//
+//                                                                               //
+// Header for FrameLog.cpp                                                       //
+//                                                                               //
+//===============================================================================//
+
+#ifndef FrameLog_H_
+#define FrameLog_H_
+
+#include <ostream>
+#include <sstream>
+#include <string>
+
+// stream for the log lines about the frame being processed by this thread (cout unless they are being captured)
+std::ostream &FrameLog();
+
+// captures the frame log lines of this thread into a string while in scope
+class FrameLogCapture
+{
+public:
+	explicit FrameLogCapture(std::string &log);
+	~FrameLogCapture();
+
+private:
+	std::ostringstream stream;
+	std::string &log;
+	std::ostream *previous;
+};
+
+#endif
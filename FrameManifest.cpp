@@ -0,0 +1,190 @@
+//===============================================================================//
+//                                                                               //
+// The manifest of a batch run records each frame as it is finished, so a run    //
+// that is stopped partway through can be started again and skip the frames      //
+// that are already done. Each line holds the fingerprints of the calibration    //
+// and of the parameters that affect the results, the altitude, the size and     //
+// checksum of the saved rectified image and the size of the saved point cloud,  //
+// followed by the rectified image, point cloud and input files.                 //
+//                                                                               //
+// Only the entries with the fingerprints of the current run are kept, so        //
+// changing the calibration or those parameters reprocesses the frames, and a    //
+// frame is only skipped if the files it saved are still there with the same     //
+// sizes (so a deleted or partly written file is saved again).                   //
+// The checksum is recorded to verify the outputs afterwards, but is not checked //
+// when skipping, which would mean reading every output file again.              //
+//                                                                               //
+//===============================================================================//
+
+#include "FrameManifest.h"
+#include "RectifyImage.h"
+
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+using namespace cv;
+using namespace std;
+
+// 64 bit FNV-1a hash
+static const unsigned long long hashBasis = 14695981039346656037ULL;
+static void HashBytes(unsigned long long &hash, const void *data, size_t nBytes)
+{
+	const unsigned long long prime = 1099511628211ULL;
+	const uchar *bytes = (const uchar*)data;
+	for (size_t i=0; i<nBytes; i++)
+		hash = (hash ^ bytes[i]) * prime;
+}
+
+static void HashMatrix(unsigned long long &hash, const Mat &matrix)
+{
+	int header[3] = {matrix.type(), matrix.rows, matrix.cols};
+	HashBytes(hash, header, sizeof(header));
+	for (int iRow=0; iRow<matrix.rows; iRow++)
+		HashBytes(hash, matrix.ptr(iRow), matrix.cols*matrix.elemSize());
+}
+
+// the rectification, the reprojection to distances and the regions that are matched
+static unsigned long long CalibrationFingerprint(const CameraMatrix &cameraMatrix)
+{
+	unsigned long long hash = hashBasis, mapFingerprint = CameraMatrixFingerprint(cameraMatrix);
+	int regions[8] = {cameraMatrix.validRoi1.x, cameraMatrix.validRoi1.y, cameraMatrix.validRoi1.width, cameraMatrix.validRoi1.height,
+		cameraMatrix.validRoi2.x, cameraMatrix.validRoi2.y, cameraMatrix.validRoi2.width, cameraMatrix.validRoi2.height};
+	HashBytes(hash, &mapFingerprint, sizeof(mapFingerprint));
+	HashMatrix(hash, cameraMatrix.Q);
+	HashBytes(hash, regions, sizeof(regions));
+	return hash;
+}
+
+// the parameters that change the saved images, point clouds or altitudes (not those that only change how fast
+// or where they are computed, or what is displayed)
+static unsigned long long ParameterFingerprint(const Parameters &parameter)
+{
+	ostringstream values;
+	values << parameter.doNotRectify << parameter.doNotSaveRectifiedImage << parameter.demosaicBeforeRectify << parameter.matchOnGreen << parameter.estimateDisparityRange
+		<< parameter.sequentialFrames << parameter.matchOverlapOnly << parameter.altitudeOnly << parameter.gateAltitude << ","
+		<< parameter.minAltitude << "," << parameter.maxAltitude << "," << parameter.altitudeGateMargin << ","
+		<< parameter.sgbmStripCount << "," << parameter.sgbmStripOverlap << "," << parameter.sgmPathCount << ","
+		<< parameter.sgmMemoryBudgetMB << "," << parameter.stereoMatcher;
+	string text = values.str();
+	unsigned long long hash = hashBasis;
+	HashBytes(hash, text.data(), text.size());
+	return hash;
+}
+
+// size of a file (-1 if it can't be opened)
+static long long FileSize(const string &filename)
+{
+	ifstream fin(filename.c_str(), ios::binary | ios::ate);
+	if (!fin.good())
+		return -1;
+	return (long long)fin.tellg();
+}
+
+// checksum of a file's contents
+static unsigned long long FileChecksum(const string &filename)
+{
+	unsigned long long hash = hashBasis;
+	ifstream fin(filename.c_str(), ios::binary);
+	vector<char> buffer(1 << 20);
+	while (fin.read(&buffer[0], buffer.size()) || fin.gcount() > 0)
+		HashBytes(hash, &buffer[0], (size_t)fin.gcount());
+	return hash;
+}
+
+
+FrameManifest::FrameManifest() : calibrationFingerprint(0), parameterFingerprint(0)
+{
+}
+
+
+bool FrameManifest::Open(string manifestFile, const CameraMatrix &cameraMatrix, const Parameters &parameter)
+{
+	calibrationFingerprint = CalibrationFingerprint(cameraMatrix);
+	parameterFingerprint = ParameterFingerprint(parameter);
+
+	// read the entries with this run's fingerprints, where a later entry of a frame replaces an earlier one
+	ifstream fin(manifestFile.c_str());
+	string line;
+	int nEntries = 0;
+	while (getline(fin, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+		nEntries++;
+		vector<string> fields;
+		istringstream lineStream(line);
+		for (string field; getline(lineStream, field, '\t'); )
+			fields.push_back(field);
+		if (fields.size() != 10)
+			continue;
+		unsigned long long entryCalibration, entryParameters;
+		istringstream(fields[0]) >> hex >> entryCalibration;
+		istringstream(fields[1]) >> hex >> entryParameters;
+		if (entryCalibration != calibrationFingerprint || entryParameters != parameterFingerprint)
+			continue;
+		Entry entry;
+		entry.altitude = stof(fields[2]);
+		entry.medianAltitude = stof(fields[3]);
+		entry.outputSize = stoll(fields[4]);
+		entry.pointCloudSize = stoll(fields[6]);
+		entry.outputFile = fields[7];
+		entry.pointCloudFile = fields[8];
+		entries[fields[9]] = entry;
+	}
+	fin.close();
+	if (nEntries > 0)
+		cout << entries.size() << " frames of the manifest " << manifestFile << " are done with this calibration and these parameters" << endl;
+
+	// add this run's frames to the end
+	file.open(manifestFile.c_str(), ios::app);
+	if (!file.good())
+	{
+		cout << "ERROR in function FrameManifest::Open: Could not open/save " << manifestFile << endl;
+		return (false);
+	}
+	if (nEntries == 0)
+		file << "# calibration\tparameters\taltitude_mm\tmedian_mm\toutput_size\toutput_checksum\tpoint_cloud_size\toutput_file"
+			<< "\tpoint_cloud_file\tinput_file" << endl;
+	return (true);
+}
+
+
+bool FrameManifest::Find(const string &inputFile, const string &outputFile, const string &pointCloudFile, float &altitude,
+	float &medianAltitude) const
+{
+	unordered_map<string, Entry>::const_iterator it = entries.find(inputFile);
+	if (it == entries.end() || it->second.outputFile != outputFile || it->second.pointCloudFile != pointCloudFile)
+		return false;
+	if (it->second.outputSize >= 0 && FileSize(outputFile) != it->second.outputSize)
+		return false;
+	if (it->second.pointCloudSize >= 0 && FileSize(pointCloudFile) != it->second.pointCloudSize)
+		return false;
+	altitude = it->second.altitude;
+	medianAltitude = it->second.medianAltitude;
+	return true;
+}
+
+
+void FrameManifest::Add(const string &inputFile, const string &outputFile, bool haveOutput, const string &pointCloudFile,
+	bool havePointCloud, float altitude, float medianAltitude)
+{
+	if (!file.is_open())
+		return;
+
+	// the output is checksummed outside the lock, since frames can finish at the same time
+	long long outputSize = haveOutput ? FileSize(outputFile) : -1;
+	unsigned long long checksum = haveOutput ? FileChecksum(outputFile) : 0;
+	long long pointCloudSize = havePointCloud ? FileSize(pointCloudFile) : -1;
+	ostringstream line;
+	line << hex << calibrationFingerprint << "\t" << parameterFingerprint << "\t" << dec << altitude << "\t" << medianAltitude << "\t"
+		<< outputSize << "\t" << hex << checksum << "\t" << dec << pointCloudSize << "\t" << outputFile << "\t" << pointCloudFile
+		<< "\t" << inputFile << endl;
+
+	lock_guard<mutex> lock(fileMutex);
+	file << line.str() << flush;
+}
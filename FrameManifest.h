@@ -0,0 +1,55 @@
+//===============================================================================//
+//                                                                               //
+// Header for FrameManifest.cpp                                                  //
+//                                                                               //
+//===============================================================================//
+
+#ifndef FrameManifest_H_
+#define FrameManifest_H_
+
+#include "GlobalDefines.h"
+#include "StereoStructDefines.h"
+
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+
+// the frames processed by earlier runs with the same calibration and parameters, and the frames processed by this run
+class FrameManifest
+{
+public:
+	FrameManifest();
+
+	// read the entries that are still valid and open the manifest to add the frames of this run
+	bool Open(std::string manifestFile, const CameraMatrix &cameraMatrix, const Parameters &parameter);
+	bool IsOpen() const {return file.is_open();}
+
+	// true if the frame was processed and the files it saved are still there (called from any thread while
+	// frames are being added)
+	bool Find(const std::string &inputFile, const std::string &outputFile, const std::string &pointCloudFile, float &altitude,
+		float &medianAltitude) const;
+
+	// record a processed frame, whose rectified image is checksummed if it was saved (called from any thread)
+	void Add(const std::string &inputFile, const std::string &outputFile, bool haveOutput, const std::string &pointCloudFile,
+		bool havePointCloud, float altitude, float medianAltitude);
+
+private:
+	struct Entry
+	{
+		std::string outputFile;
+		std::string pointCloudFile;
+		long long outputSize;		// -1 if no rectified image was saved (e.g. an invalid altitude)
+		long long pointCloudSize;	// -1 if no point cloud was saved
+		float altitude;
+		float medianAltitude;
+	} ;
+
+	unsigned long long calibrationFingerprint;
+	unsigned long long parameterFingerprint;
+	std::unordered_map<std::string, Entry> entries;		// by input file, only read once the manifest is open
+	std::ofstream file;
+	std::mutex fileMutex;
+};
+
+#endif
@@ -28,12 +28,43 @@ template <typename T> std::string toString(const T& t)
 struct Parameters
 {
 	bool doNotRectify;
+	bool doNotSaveRectifiedImage;
+	bool demosaicBeforeRectify;
+	bool matchOnGreen;
+	bool estimateDisparityRange;
+	bool sequentialFrames;
+	bool matchOverlapOnly;
+	bool altitudeOnly;
+	bool gateAltitude;
+	bool mergeShardLogs;
+	bool ingestStdin;
+	bool benchmarkMatcher;
 	bool pauseForKeystroke;
 	bool displayRectifiedImage;
 	bool displayDisparityImage;
 	int nHorizontal;
 	int nVertical;
 	float squareSize;
+	float minAltitude;
+	float maxAltitude;
+	float altitudeGateMargin;
+	int demosaicThreadCount;
+	int pipelineDepth;
+	int workerCount;
+	int shardIndex;
+	int shardCount;
+	int firstFrame;
+	int lastFrame;
+	int ingestPollInterval;
+	int sgbmStripCount;
+	int sgbmStripOverlap;
+	int sgmPathCount;
+	int sgmMemoryBudgetMB;
+	std::string stereoMatcher;
+	std::string altitudeLogFile;
+	std::string manifestFile;
+	std::string ingestDirectory;
+	std::string outputDirectory;
 	std::string rectificationImageListFile;
 	std::string calibrationImageListFile;
 	std::string calibrationDataDirectory;
@@ -0,0 +1,458 @@
+//===============================================================================//
+//                                                                               //
+// This function rectifies each joined stereo pair of an image list, computes    //
+// its point cloud and altitude, and saves the rectified pair and point cloud    //
+// of the frames with a valid altitude.                                          //
+//                                                                               //
+// Each frame goes through four stages: read (decode), rectify (demosaic and     //
+// rectify, or the sparse altitude), reconstruct (match and reproject) and save  //
+// (encode and write). With a pipeline depth the stages run on their own threads //
+// connected by bounded queues of that depth, so reading and writing overlap the //
+// computation of other frames; the frames still finish in the list's order.     //
+//                                                                               //
+// With more than one worker, whole frames are processed at once instead, on a   //
+// work-stealing pool where each worker has its own matcher and buffers (the     //
+// calibration and rectification maps are shared). The log lines of each frame   //
+// are printed together, in the list's order.                                    //
+//                                                                               //
+// The altitude of each frame is also written to the altitude log, if there is   //
+// one, in the list's order (one log per shard when the list is sharded).        //
+//                                                                               //
+// With a manifest, each finished frame is recorded in it, and the frames that   //
+// an earlier run already finished (with the same calibration and parameters)    //
+// are skipped; their altitudes are taken from the manifest.                     //
+//                                                                               //
+// ProcessIngestedFrames does the same for the frames of a live run as they      //
+// arrive, one at a time with the same matcher and buffers, so the altitude of   //
+// each frame is printed as soon as it is computed.                              //
+//                                                                               //
+// Input:   inputList         Joined stereo pair image files                     //
+//          outputList        Rectified image pair files                         //
+//          frameNumbers      Frame numbers of the files in the whole list       //
+//          cameraMatrix      Camera calibration matrices                        //
+//          parameter         User-controlled parameters, of which these apply:  //
+//            pipelineDepth   Frames queued between stages (0 runs serially)     //
+//            workerCount     Frames processed at once (0 for one per core)      //
+//            altitudeLogFile Altitude log (none if empty)                       //
+//            manifestFile    Manifest of finished frames (none if empty)        //
+//            all the parameters of AltitudeFromStereo                           //
+//                                                                               //
+//===============================================================================//
+
+#include "ProcessImageList.h"
+#include "AltitudeFromStereo.h"
+#include "Reconstruct3dImage.h"
+#include "DataIO.h"
+#include "FileIO.h"
+#include "FrameManifest.h"
+#include "FrameIngest.h"
+#include "BoundedQueue.h"
+#include "WorkStealingPool.h"
+#include "FrameLog.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+using namespace cv;
+using namespace std;
+
+// a frame of the image list as it moves through the stages
+struct StereoFrame
+{
+	StereoFrame() : index(-1), number(-1), haveImage(false), done(false), needReconstruction(false), altitude(0.f) {}
+
+	int index;					// position in the image list (-1 marks the end of the list)
+	int number;					// frame number in the whole list (which differs from the index in a shard)
+	bool haveImage;				// false if the image could not be read
+	bool done;					// true if the frame was finished by an earlier run (so it is not read)
+	bool needReconstruction;	// false if the altitude is already known from sparse matches
+	float altitude;
+	string cfaPattern;
+	string log;					// log lines of the frame when they are printed as a group
+	string name;				// names the point cloud file instead of the frame number (if not empty)
+	Mat image;
+	Mat imageRectified;
+	Mat imageMatch;
+	PointCloud pointCloud;
+} ;
+
+typedef BoundedQueue<StereoFrame> FrameQueue;
+
+// prints the logs (and writes the altitude records) of frames that finish in any order as groups in the order of the list
+class OrderedFrameLog
+{
+public:
+	OrderedFrameLog(int nFrames, ofstream &altitudeLog) : altitudeLog(altitudeLog), logs(nFrames), records(nFrames),
+		finished(nFrames, false), next(0) {}
+	void Finish(int index, const string &log, const string &record)
+	{
+		lock_guard<mutex> lock(logMutex);
+		logs[index] = log;
+		records[index] = record;
+		finished[index] = true;
+		for (; next<(int)finished.size() && finished[next]; next++)
+		{
+			cout << logs[next] << flush;
+			if (altitudeLog.is_open())
+				altitudeLog << records[next] << flush;
+			logs[next].clear();
+		}
+	}
+
+private:
+	mutex logMutex;
+	ofstream &altitudeLog;
+	vector<string> logs;
+	vector<string> records;
+	vector<bool> finished;
+	int next;
+} ;
+
+
+// the point cloud file of a frame (without the extension added for its format)
+static string PointCloudFile(const StereoFrame &frame)
+{
+	string name = frame.name.empty() ? toString(frame.number) : frame.name;
+	return "C:/Users/Peterh~1/Desktop/PointCloud" + name;	//*********** TEMPORARY UNTIL WE AGREE ON WHERE IT SHOULD GO *******
+}
+
+// the point cloud file as written in the binary format
+static string PointCloudDataFile(const StereoFrame &frame)
+{
+	return PointCloudFile(frame) + ".dat";
+}
+
+
+// read the image to be processed, unless the manifest has it as finished
+static void ReadFrame(StereoFrame &frame, const string &filename, const string &outputFile, const FrameManifest &manifest)
+{
+	if (manifest.IsOpen() && manifest.Find(filename, outputFile, PointCloudDataFile(frame), frame.altitude, frame.pointCloud.medianDistance))
+	{
+		FrameLog() << "Already processed, skipping file " << filename << endl;
+		frame.haveImage = frame.done = true;
+		return;
+	}
+	frame.image = imread(filename, CV_LOAD_IMAGE_ANYCOLOR | CV_LOAD_IMAGE_ANYDEPTH);
+	frame.haveImage = !frame.image.empty();
+	if (!frame.haveImage)
+	{
+		FrameLog() << "Error in mainRectify: unable to either find or read image " << filename << endl;
+		return;
+	}
+
+	// check for tiff files, which are raw images that get debayered during rectification (output is CV_U16C3 matrix type)
+	unsigned found = (unsigned)filename.find_last_of(".");
+	if (filename.substr(found+1) == "tif" || filename.substr(found+1) == "tiff")
+	{
+		//cvtColor(image, image, CV_BayerBG2BGR);		// CV_BayerBG2BGR is RGGB
+		frame.cfaPattern = "RGGB";
+	}
+}
+
+
+// rectify the pair (or get the altitude from sparse matches), where nFrames is 0 if the number of frames is not known
+static void RectifyFrame(StereoFrame &frame, const CameraMatrix &cameraMatrix, const Parameters &parameter, int nFrames)
+{
+	if (!frame.haveImage || frame.done)
+		return;
+	FrameLog() << "Computing rectification, point cloud and altitude " << frame.index+1;
+	if (nFrames > 0)
+		FrameLog() << " of " << nFrames;
+	FrameLog() << endl;
+	frame.needReconstruction = RectifyStereoPair(frame.image, cameraMatrix, frame.imageRectified, frame.imageMatch,
+		frame.pointCloud, parameter, frame.cfaPattern);
+	if (!frame.needReconstruction)
+		frame.altitude = frame.pointCloud.meanDistance;
+	frame.image.release();
+}
+
+
+// match the rectified pair and compute the point cloud, where keepPointCloud takes the point cloud data away
+// from the context (which otherwise reuses it for the next frame)
+static void ReconstructFrame(StereoFrame &frame, ReconstructionContext &context, const CameraMatrix &cameraMatrix,
+	const Parameters &parameter, bool keepPointCloud)
+{
+	if (!frame.haveImage)
+		return;
+
+	// the frame before the next one was skipped, so it has no prior
+	if (frame.done)
+	{
+		context.havePriorDisparity = false;
+		return;
+	}
+	if (frame.needReconstruction)
+	{
+		frame.pointCloud = Reconstruct3dImage(frame.imageMatch, cameraMatrix, context, parameter, parameter.displayDisparityImage,
+			parameter.pauseForKeystroke);
+		frame.altitude = frame.pointCloud.meanDistance;
+		if (keepPointCloud)
+			context.pointCloud.release();
+	}
+	frame.imageMatch.release();
+
+	// don't narrow the next frame's search to a frame with an invalid altitude
+	if (frame.altitude < parameter.minAltitude || frame.altitude > parameter.maxAltitude)
+		context.havePriorDisparity = false;
+}
+
+
+// check altitude for a valid range (1 to 3 1/2 meters perhaps?) and save data if okay, then record the frame as
+// finished in the manifest (unless something could not be saved)
+static void SaveFrame(StereoFrame &frame, const string &inputFile, const string &outputFile, const Parameters &parameter,
+	FrameManifest &manifest)
+{
+	if (!frame.haveImage || frame.done)
+		return;
+	float altitude = frame.altitude;
+	if (altitude < parameter.minAltitude || altitude > parameter.maxAltitude)
+	{
+		FrameLog() << "Invalid computed altitude. Skipping file " << inputFile << endl;
+		manifest.Add(inputFile, outputFile, false, PointCloudDataFile(frame), false, altitude, frame.pointCloud.medianDistance);
+		return;
+	}
+	FrameLog() << "Altitude " << altitude << " mm (median " << frame.pointCloud.medianDistance << " mm)" << endl;
+	if (parameter.altitudeOnly)
+	{
+		manifest.Add(inputFile, outputFile, false, PointCloudDataFile(frame), false, altitude, frame.pointCloud.medianDistance);
+		return;
+	}
+
+	// save the rectified image pair to disk, but never over the input image
+	bool saved = true, haveOutput = false;
+	if (!parameter.doNotRectify && !parameter.doNotSaveRectifiedImage && CanonicalPath(outputFile) == CanonicalPath(inputFile))
+	{
+		FrameLog() << endl << "ERROR in function SaveFrame: Rectified image would overwrite the input image " << inputFile << endl;
+		saved = false;
+	}
+	else if (!parameter.doNotRectify && !parameter.doNotSaveRectifiedImage)
+	{
+		FrameLog() << "Saving rectified image pair" << endl;
+		haveOutput = imwrite(outputFile, frame.imageRectified);
+		if (!haveOutput)
+		{
+			FrameLog() << endl << "ERROR in function WritePointCloud: Could not open/save " << outputFile << endl;
+			saved = false;
+		}
+	}
+	// save the point cloud to disk
+	FrameLog() << "Saving point cloud" << endl;
+	string filename = PointCloudFile(frame);
+	if (!WritePointCloud(filename, frame.pointCloud, frame.imageRectified, PC_BINARY))
+	{
+		FrameLog() << endl << "ERROR in function WritePointCloud: Could not open/save " << filename << endl;
+		saved = false;
+	}
+	if (saved)
+		manifest.Add(inputFile, outputFile, haveOutput, PointCloudDataFile(frame), true, altitude, frame.pointCloud.medianDistance);
+}
+
+
+// the altitude log record of a frame: frame number, altitude and median in mm, status and image file
+static string AltitudeRecord(const StereoFrame &frame, const string &inputFile, const Parameters &parameter)
+{
+	const char *status = "ok";
+	if (!frame.haveImage)
+		status = "unreadable";
+	else if (frame.altitude < parameter.minAltitude || frame.altitude > parameter.maxAltitude)
+		status = "invalid";
+	ostringstream record;
+	record << frame.number << "," << frame.altitude << "," << frame.pointCloud.medianDistance << "," << status << "," << inputFile << endl;
+	return record.str();
+}
+
+
+// open this shard's altitude log (if there is one)
+static void OpenAltitudeLog(ofstream &altitudeLog, const Parameters &parameter)
+{
+	if (parameter.altitudeLogFile.empty())
+		return;
+	string logFile = ShardLogFileName(parameter.altitudeLogFile, parameter.shardIndex, parameter.shardCount);
+	altitudeLog.open(logFile.c_str());
+	if (altitudeLog.good())
+		altitudeLog << "# frame,altitude_mm,median_mm,status,input_file" << endl;
+	else
+		cout << "ERROR in function ProcessImageList: Could not open/save " << logFile << endl;
+}
+
+
+void ProcessImageList(const vector<string> &inputList, const vector<string> &outputList, const vector<int> &frameNumbers,
+	const CameraMatrix &cameraMatrix, const Parameters &parameter)
+{
+	ReconstructionContext context;	// stereo matcher and buffers shared by all the frames
+	int nFrames = (int)inputList.size();
+
+	// open the altitude log and the manifest of finished frames
+	ofstream altitudeLog;
+	OpenAltitudeLog(altitudeLog, parameter);
+	FrameManifest manifest;
+	if (!parameter.manifestFile.empty())
+		manifest.Open(parameter.manifestFile, cameraMatrix, parameter);
+	int workerCount = parameter.workerCount > 0 ? parameter.workerCount : getNumberOfCPUs();
+	workerCount = max(1, min(workerCount, nFrames));
+
+	// process whole frames at once on a pool of workers, each with its own context (images can only be displayed
+	// from the main thread, so they are not displayed)
+	if (workerCount > 1)
+	{
+		Parameters workerParameter = parameter;
+		if (parameter.displayRectifiedImage || parameter.displayDisparityImage)
+		{
+			cout << "Images are not displayed when several frames are processed at once" << endl;
+			workerParameter.displayRectifiedImage = false;
+			workerParameter.displayDisparityImage = false;
+		}
+		vector<ReconstructionContext> contexts(workerCount);
+		vector<int> previousItem(workerCount, -2);	// the last frame each worker processed
+		OrderedFrameLog orderedLog(nFrames, altitudeLog);
+		WorkStealingPool pool(workerCount);
+		pool.Run(nFrames, [&](int worker, int i)
+		{
+			// the disparity range of a worker's last frame is only a prior for the frame right after it (not for one
+			// stolen from another worker's queue)
+			if (i != previousItem[worker] + 1)
+				contexts[worker].havePriorDisparity = false;
+			previousItem[worker] = i;
+
+			StereoFrame frame;
+			frame.index = i;
+			frame.number = frameNumbers[i];
+			{
+				FrameLogCapture capture(frame.log);
+				ReadFrame(frame, inputList[i], outputList[i], manifest);
+				RectifyFrame(frame, cameraMatrix, workerParameter, nFrames);
+				ReconstructFrame(frame, contexts[worker], cameraMatrix, workerParameter, false);
+				SaveFrame(frame, inputList[i], outputList[i], workerParameter, manifest);
+			}
+			orderedLog.Finish(i, frame.log, AltitudeRecord(frame, inputList[i], workerParameter));
+		});
+		return;
+	}
+
+	// images can only be displayed from the main thread, so displaying them turns the pipeline off
+	bool pipelined = parameter.pipelineDepth > 0;
+	if (pipelined && (parameter.displayRectifiedImage || parameter.displayDisparityImage))
+	{
+		cout << "Images are displayed, so the frames are processed without a pipeline" << endl;
+		pipelined = false;
+	}
+
+	// process the frames one at a time
+	if (!pipelined)
+	{
+		for (int i=0; i<nFrames; i++)
+		{
+			StereoFrame frame;
+			frame.index = i;
+			frame.number = frameNumbers[i];
+			ReadFrame(frame, inputList[i], outputList[i], manifest);
+			RectifyFrame(frame, cameraMatrix, parameter, nFrames);
+			ReconstructFrame(frame, context, cameraMatrix, parameter, false);
+			SaveFrame(frame, inputList[i], outputList[i], parameter, manifest);
+			if (altitudeLog.is_open())
+				altitudeLog << AltitudeRecord(frame, inputList[i], parameter) << flush;
+		}
+		return;
+	}
+
+	// or run the read, rectify and reconstruct stages on their own threads and save on this one, where each stage
+	// passes the frames on in order and then an end of list frame (index -1), and adds its log lines to the frame's
+	FrameQueue readQueue(parameter.pipelineDepth), rectifyQueue(parameter.pipelineDepth), reconstructQueue(parameter.pipelineDepth);
+	thread readThread([&]()
+	{
+		for (int i=0; i<nFrames; i++)
+		{
+			StereoFrame frame;
+			frame.index = i;
+			frame.number = frameNumbers[i];
+			{
+				FrameLogCapture capture(frame.log);
+				ReadFrame(frame, inputList[i], outputList[i], manifest);
+			}
+			readQueue.Push(frame);
+		}
+		readQueue.Push(StereoFrame());
+	});
+	thread rectifyThread([&]()
+	{
+		StereoFrame frame;
+		for (readQueue.Pop(frame); frame.index >= 0; readQueue.Pop(frame))
+		{
+			{
+				FrameLogCapture capture(frame.log);
+				RectifyFrame(frame, cameraMatrix, parameter, nFrames);
+			}
+			rectifyQueue.Push(frame);
+		}
+		rectifyQueue.Push(frame);
+	});
+	thread reconstructThread([&]()
+	{
+		StereoFrame frame;
+		for (rectifyQueue.Pop(frame); frame.index >= 0; rectifyQueue.Pop(frame))
+		{
+			{
+				FrameLogCapture capture(frame.log);
+				ReconstructFrame(frame, context, cameraMatrix, parameter, true);
+			}
+			reconstructQueue.Push(frame);
+		}
+		reconstructQueue.Push(frame);
+	});
+
+	StereoFrame frame;
+	for (reconstructQueue.Pop(frame); frame.index >= 0; reconstructQueue.Pop(frame))
+	{
+		{
+			FrameLogCapture capture(frame.log);
+			SaveFrame(frame, inputList[frame.index], outputList[frame.index], parameter, manifest);
+		}
+		cout << frame.log << flush;
+		if (altitudeLog.is_open())
+			altitudeLog << AltitudeRecord(frame, inputList[frame.index], parameter) << flush;
+	}
+
+	readThread.join();
+	rectifyThread.join();
+	reconstructThread.join();
+}
+
+
+void ProcessIngestedFrames(FrameIngest &ingest, const CameraMatrix &cameraMatrix, const Parameters &parameter)
+{
+	ReconstructionContext context;	// stereo matcher and buffers kept warm from frame to frame
+
+	ofstream altitudeLog;
+	OpenAltitudeLog(altitudeLog, parameter);
+	FrameManifest manifest;
+	if (!parameter.manifestFile.empty())
+		manifest.Open(parameter.manifestFile, cameraMatrix, parameter);
+
+	// process each frame as soon as it arrives
+	string inputFile, outputFile;
+	for (int i=0; ingest.Next(inputFile, outputFile); i++)
+	{
+		// the point cloud is named after the input file, as the frame numbers start again when a live run restarts
+		StereoFrame frame;
+		frame.index = frame.number = i;
+		size_t separator = inputFile.find_last_of("/\\"), found = inputFile.find_last_of(".");
+		size_t start = separator == string::npos ? 0 : separator+1;
+		frame.name = inputFile.substr(start, found == string::npos || found < start ? string::npos : found-start);
+		ReadFrame(frame, inputFile, outputFile, manifest);
+		RectifyFrame(frame, cameraMatrix, parameter, 0);
+		ReconstructFrame(frame, context, cameraMatrix, parameter, false);
+		SaveFrame(frame, inputFile, outputFile, parameter, manifest);
+		cout << flush;
+		if (altitudeLog.is_open())
+			altitudeLog << AltitudeRecord(frame, inputFile, parameter) << flush;
+	}
+}
@@ -0,0 +1,22 @@
+//===============================================================================//
+//                                                                               //
+// Header for ProcessImageList.cpp                                               //
+//                                                                               //
+//===============================================================================//
+
+#ifndef ProcessImageList_H_
+#define ProcessImageList_H_
+
+#include "GlobalDefines.h"
+#include "StereoStructDefines.h"
+#include "FrameIngest.h"
+#include <opencv2/core/core.hpp>
+
+#include <string>
+#include <vector>
+
+void ProcessImageList(const std::vector<std::string> &inputList, const std::vector<std::string> &outputList,
+	const std::vector<int> &frameNumbers, const CameraMatrix &cameraMatrix, const Parameters &parameter);
+void ProcessIngestedFrames(FrameIngest &ingest, const CameraMatrix &cameraMatrix, const Parameters &parameter);
+
+#endif
@@ -4,17 +4,34 @@
 // and then computes a point cloud in mm coordinates adjusted for water using    //
 // the refraction index of salt water (1.33)                                     //
 //                                                                               //
-// Input:   image             Input image (rectified pair)                       //
+// Input:   image             Input image (rectified pair, color or gray)        //
 //          Q                 Pixel to world coordinates transformation matrix   //
+//          context           Matcher and buffers reused from frame to frame     //
+//          parameter         User-controlled parameters, of which these apply:  //
+//            estimateDisparityRange  Narrow the search to the range estimated   //
+//                            at reduced resolution (much faster)                //
+//            sequentialFrames  Narrow the search to the range found in the      //
+//                            previous frame matched with the same context       //
+//            matchOverlapOnly  Only match the columns kept in the point cloud,  //
+//                            using the mean disparity expected from the above   //
+//            sgbmStripCount, sgbmStripOverlap  Match in parallel strips         //
+//            benchmarkMatcher  Compare the strip and whole frame matchers       //
+//            stereoMatcher, sgmPathCount, sgmMemoryBudgetMB  Matcher selection  //
 //          displayImage      A boolean option to display images as processed    //
 //          pauseForKeystroke A boolean option to pause if image is displayed    //
 // Output:  returned value    A 3 channel (x,y,z) point cloud matrix in mm       //
+//                            (the data is held by the context and is only valid //
+//                            until its next use)                                //
 //                                                                               //
 // Author:                    Peter Honig, phonig@whoi.edu, March 25 2015        //
 //                                                                               //
 //===============================================================================//
 
 #include "Reconstruct3dImage.h"
+#include "EstimateDisparityRange.h"
+#include "ComputeDisparity.h"
+#include "RectifyImage.h"
+#include "FrameLog.h"
 
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -25,134 +42,255 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <cmath>
+#include <climits>
+#include <cfloat>
 
 using namespace cv;
 using namespace std;
 
-
-PointCloud Reconstruct3dImage(Mat image, CameraMatrix cameraMatrix, bool displayImage, bool pauseForKeystroke)
+// count, range, mean and median of the valid disparities (in pixels, with the trim compensation)
+struct DisparityStatistics
+{
+	int count;
+	float minDisparity;
+	float maxDisparity;
+	float meanDisparity;
+	float medianDisparity;
+} ;
+
+// range of the x and y world coordinates of the valid points of a point cloud
+struct PointCloudRange
+{
+	float minX3D;
+	float maxX3D;
+	float minY3D;
+	float maxY3D;
+} ;
+
+static bool DisparityWindowIsConsistent(const Mat &disparity16S, int minDisparity, int nDisparities, int fullDisparities);
+static void IntensityPercentiles(const Mat &image1, const Mat &image2, double tailFraction, vector<int> &histogram,
+	double &low, double &high);
+static float MeanValidDisparity(const Mat &disparity16S, int validThreshold16, int trim);
+static void ProcessDisparity(const Mat &disparity16S, int firstColumn, int validThreshold16, int trim, bool maskCorner, Mat &disparity,
+	Mat &mask, vector<int> &histogram, DisparityStatistics &statistics);
+static void BuildReprojectionTable(const Mat_<double> &q, int maxDisparity16, vector<Vec4d> &table);
+static float TableDistance(const vector<Vec4d> &table, float disparity, float waterRefractionIndex);
+static void ReprojectDisparity(const Mat &disparity, const Mat_<double> &q, const vector<Vec4d> &table, float waterRefractionIndex,
+	Mat &pointCloud, PointCloudRange &range);
+
+
+PointCloud Reconstruct3dImage(Mat image, const CameraMatrix &cameraMatrix, ReconstructionContext &context, const Parameters &parameter,
+	bool displayImage, bool pauseForKeystroke)
 {
 	PointCloud pointCloud;
-	Mat imageLeft, imageRight, disparity;
-	Mat maskValid8U, maskValid, maskInvalid, maskOffset;
-	Mat pointMatrix = Mat(1, 1, CV_32FC1), pointMatrix3D;
+	Mat &imageLeft = context.imageLeft, &imageRight = context.imageRight, disparity;
+	Mat &maskValid8U = context.maskValid8U;
 	double minVal, maxVal;
 
 	double minMeanDisparity = 207.;			// lower limit of mean disparity (725500 / 207 disparity = 3500mm distance of camera)
 	float waterRefractionIndex = 1.33f;		// 1.33 for salt water
 	int trim = 25;							// amount to trim off each edge to because of image rotation
 
-	// trim off pixels for black edges due to correction of lens distortion
-	image = image(Rect(trim, trim, image.cols-(2*trim), image.rows-(2*trim))).clone();
-
-	// if needed, convert to 8 bits per channel and scale intensity range to 0-255
-	if (image.type() != CV_8UC3)
+	// the regions of the stereo halves that are matched are the valid regions of the rectification if the calibration
+	// has them, otherwise the halves with the pixels for black edges due to correction of lens distortion trimmed off
+	// (which also masks out the upper left corner where lens distortion creates inaccuracies); both regions are cut to
+	// the same rows and width, and the difference of their left edges is added to the matched disparities
+	int halfWidth = image.cols/2;
+	Rect regionLeft, regionRight;
+	bool haveValidRegions = GetValidRegions(cameraMatrix, Size(halfWidth, image.rows), regionLeft, regionRight);
+	if (haveValidRegions)
 	{
-		minMaxLoc(image, &minVal, &maxVal);
-		image.convertTo(image, CV_8UC3, 255./(maxVal-minVal), -minVal*255./(maxVal-minVal));
+		int top = max(regionLeft.y, regionRight.y);
+		int bottom = min(regionLeft.y + regionLeft.height, regionRight.y + regionRight.height);
+		int width = min(regionLeft.width, regionRight.width);
+		regionLeft = Rect(regionLeft.x, top, width, max(bottom - top, 0));
+		regionRight = Rect(regionRight.x, top, width, max(bottom - top, 0));
+	}
+	if (!haveValidRegions || regionLeft.height == 0)
+	{
+		haveValidRegions = false;
+		regionLeft = Rect(trim, trim, halfWidth-trim, image.rows-(2*trim));
+		regionRight = Rect(0, trim, halfWidth-trim, image.rows-(2*trim));
+	}
+	int disparityOffset = regionLeft.x - regionRight.x;
+	Mat imageRegionLeft = image(regionLeft);
+	Mat imageRegionRight = image(regionRight + Point(halfWidth, 0));
+
+	// crop the regions out of the pair and, if needed, convert them to 8 bits per channel (as the matchers need) in the
+	// same pass, stretching the intensity range between the low and high percentiles of a sample of the pixels to 0-255
+	// so that a few specular highlights don't compress the contrast of the rest (color or single channel)
+	if (image.depth() != CV_8U)
+	{
+		double stretchTail = 0.005;		// fraction of the pixels saturated at each end of the range
+		if (image.depth() == CV_16U)
+			IntensityPercentiles(imageRegionLeft, imageRegionRight, stretchTail, context.intensityHistogram, minVal, maxVal);
+		else
+		{
+			double minValRight, maxValRight;
+			minMaxLoc(imageRegionLeft, &minVal, &maxVal);
+			minMaxLoc(imageRegionRight, &minValRight, &maxValRight);
+			minVal = min(minVal, minValRight);
+			maxVal = max(maxVal, maxValRight);
+		}
+		double scale = 255./max(maxVal-minVal, 1.);
+		imageRegionLeft.convertTo(imageLeft, CV_8U, scale, -minVal*scale);
+		imageRegionRight.convertTo(imageRight, CV_8U, scale, -minVal*scale);
+	}
+	else
+	{
+		imageRegionLeft.copyTo(imageLeft);
+		imageRegionRight.copyTo(imageRight);
 	}
 
-	// crop the image to remove right stereo half
-	imageLeft = image(Rect(0, 0, image.cols/2, image.rows)).clone();
-	imageRight = image(Rect(image.cols/2, 0, image.cols/2, image.rows)).clone();
-
-	// call the StereoSGBM constructor (stereo correspondence Semi-Global Block Matching algorithm)
+	// set up the StereoSGBM matcher (stereo correspondence Semi-Global Block Matching algorithm)
 	// this is slow but very accurate and vastly superior to StereoBM (Block Matching algorithm)
-	int minDisp = 0;			// 0 always
-	int nDisparities = 16*25;	// 16*25 works best
+	// the full search range is narrowed to the range found in the previous frame of a sequence if there is one,
+	// otherwise to the range of this frame if it can be estimated at reduced resolution
+	int fullDisparities = 16*25;		// 16*25 works best for the full search
+	int priorMargin = 32;				// disparities added to each end of the previous frame's range
+	int minDisparity = 0;				// 0 for the full search
+	int nDisparities = fullDisparities;
+	float expectedMeanDisparity = 0.f;	// mean disparity expected from the previous frame or the estimate (0 if unknown)
+	if (parameter.sequentialFrames && context.havePriorDisparity)
+	{
+		expectedMeanDisparity = context.priorMeanDisparity;
+		minDisparity = max(0, context.priorMinDisparity - priorMargin);
+		int maxDisparity = min(fullDisparities, context.priorMaxDisparity + priorMargin);
+		nDisparities = min(fullDisparities, ((maxDisparity - minDisparity + 15) / 16) * 16);
+		if (minDisparity + nDisparities > fullDisparities)
+			minDisparity = max(0, fullDisparities - nDisparities);
+	}
+	else if (parameter.estimateDisparityRange)
+	{
+		float estimatedMeanDisparity;
+		if (EstimateDisparityRange(imageLeft, imageRight, fullDisparities, minDisparity, nDisparities, context, &estimatedMeanDisparity))
+			expectedMeanDisparity = estimatedMeanDisparity + disparityOffset;
+	}
 	int SADWindowSize = 5;		// 1, 3, or 5 (5 works best by far)
-	int p1 =  8 * 6 * SADWindowSize * SADWindowSize;
-	int p2 = 32 * 6 * SADWindowSize * SADWindowSize;
-	int disp12MaxDiff = 0;		// 0 always
-	int uniquenessRatio = 1;	// 1 to 10
-	int speckleWindowSize = 100;
-	StereoSGBM sgbm(minDisp, nDisparities, SADWindowSize, p1, p2, disp12MaxDiff, 0, uniquenessRatio, speckleWindowSize , 2, true);
+	StereoSGBM &sgbm = context.sgbm;
+	sgbm.minDisparity = minDisparity;
+	sgbm.numberOfDisparities = nDisparities;
+	sgbm.SADWindowSize = SADWindowSize;
+	sgbm.P1 =  8 * 6 * SADWindowSize * SADWindowSize;
+	sgbm.P2 = 32 * 6 * SADWindowSize * SADWindowSize;
+	sgbm.disp12MaxDiff = 0;				// 0 always
+	sgbm.preFilterCap = 0;
+	sgbm.uniquenessRatio = 1;			// 1 to 10
+	sgbm.speckleWindowSize = 100;
+	sgbm.speckleRange = 2;
+	sgbm.fullDP = true;
+
+	// the point cloud keeps the columns right of the mean disparity, so if it is expected, only those columns are matched
+	// (starting far enough to their left for the whole search range, as the matcher leaves the first minDisparity +
+	// nDisparities columns of what it matches unmatched)
+	int expectedFirstColumn = 0, matchColumn = 0;
+	if (parameter.matchOverlapOnly && expectedMeanDisparity > 0.f)
+	{
+		expectedFirstColumn = min((int)expectedMeanDisparity, imageLeft.cols);
+		matchColumn = max(0, expectedFirstColumn - (minDisparity + nDisparities));
+	}
 
 	// calculate the disparity (returned values are the pixel disparities multiplied by 16)
-	sgbm(imageLeft, imageRight, disparity);
-
-	// convert disparity to floating point pixel values and divide by 16 then add back the border that was previously trimmed
-	disparity.convertTo(disparity, CV_32FC1, 1./16.);
-	copyMakeBorder(disparity, disparity, trim, trim, trim, 0, BORDER_CONSTANT, Scalar(-1.f));
-
-	// generate masks for all valid and invalid pixels using a min disparity at 3.5 meters (~407 disparity)
-	threshold(disparity, maskValid, minMeanDisparity-(double)trim, 0.0, THRESH_TOZERO);				// disparity values at valid pixels
-	threshold(disparity, maskInvalid, minMeanDisparity-(double)trim, -1.0, THRESH_BINARY_INV);		// value of -1 at invalid pixels
-	threshold(disparity, maskOffset, minMeanDisparity-(double)trim, (double)trim, THRESH_BINARY);	// compensation for trim at valid pixels
+	ComputeDisparity(imageLeft.colRange(matchColumn, imageLeft.cols), imageRight.colRange(matchColumn, imageRight.cols),
+		context.disparity16S, context, parameter);
 
-	// sum all the masks to get disparity values + trim compensation at valid pixels and -1 at invalid pixels
-	disparity = maskValid + maskOffset + maskInvalid;
+	// repeat with the full range if the scene does not fit well inside a narrowed range
+	if (nDisparities < fullDisparities && !DisparityWindowIsConsistent(context.disparity16S, minDisparity, nDisparities, fullDisparities))
+	{
+		FrameLog() << "Disparity range " << minDisparity << " to " << minDisparity+nDisparities << " rejected, searching the full range" << endl;
+		minDisparity = 0;
+		nDisparities = fullDisparities;
+		sgbm.minDisparity = minDisparity;
+		sgbm.numberOfDisparities = nDisparities;
+		if (matchColumn > 0)
+			matchColumn = max(0, expectedFirstColumn - nDisparities);
+		ComputeDisparity(imageLeft.colRange(matchColumn, imageLeft.cols), imageRight.colRange(matchColumn, imageRight.cols),
+			context.disparity16S, context, parameter);
+	}
 
 	// FIRST ITERATION: compute mean value of all valid disparity pixels to determine the non-overlapping region of the left image
-	maskValid.convertTo(maskValid8U, CV_8UC1);
-	Scalar meanDisparityScalar = mean(disparity, maskValid8U);	// mask must be type CV_8UC1
-	float meanDisparity = (float)meanDisparityScalar.val[0];
-
-	// use mean disparty and edge trim to trim away regions where there is no disparity data,
-	// then mask out the upper left of the remaining image with a triangle where lens distortion creates inaccuracies
-	disparity = disparity(Rect((int)meanDisparity+trim, trim, disparity.cols-(int)meanDisparity-trim, disparity.rows-(2*trim))).clone();
-	triangle(disparity, Point(0, 0), Point(0, 250), Point(150, 0), Scalar(-1.0));
-	pointCloud.trimLeft = (int)meanDisparity+trim;
-	pointCloud.trimRight = 0;
-	pointCloud.trimTop = trim;
-	pointCloud.trimBottom = trim;
-
-	// SECOND ITERATION: get new mask for valid pixels, find the minimum and maximum disparities and the refine mean disparity
-	threshold(disparity, maskValid, 0.0, 1.0, THRESH_TOZERO);	// mask values at valid pixels are 1, otherwise 0
-	maskValid.convertTo(maskValid8U, CV_8UC1);
-	minMaxLoc(disparity, &minVal, &maxVal, 0, 0, maskValid8U);	// mask must be type CV_8UC1
-	meanDisparityScalar = mean(disparity, maskValid8U);
-	meanDisparity = (float)meanDisparityScalar.val[0];
-
-	// compute MIN distance in world coordinates (from MAXimum disparity)
-	pointMatrix.at<float>(0,0) = (float) maxVal;
-	reprojectImageTo3D(pointMatrix, pointMatrix3D, cameraMatrix.Q);
-	pointCloud.minDistance = pointMatrix3D.at<Vec3f>(0,0)[2] * waterRefractionIndex;	// correct for water density
+	// (valid pixels are above a min disparity at 3.5 meters (~407 disparity), and as the matcher marks unmatched pixels
+	// with minDisparity-1, a narrowed range can raise the threshold; disparities are compensated for the trim)
+	// if only the overlap was matched, this is the mean of the matched columns, and the columns left of them are never kept
+	double validThreshold = max(minMeanDisparity-(double)disparityOffset, (double)(minDisparity-1));
+	int validThreshold16 = (int)floor(validThreshold*16.);
+	float meanDisparity = MeanValidDisparity(context.disparity16S, validThreshold16, disparityOffset);
+	float firstMeanDisparity = meanDisparity;
+
+	// use mean disparty to trim away the region where there is no disparity data, and in the same pass mask out the
+	// upper left of the remaining image where lens distortion creates inaccuracies (unless the regions came from the
+	// calibration), mark invalid pixels with -1
+	// (the cropped disparities are kept in 16-bit fixed point, pixels * 16), and find the minimum, maximum, mean and
+	// median disparities (SECOND ITERATION)
+	int firstColumn = min(max((int)meanDisparity, matchColumn), imageLeft.cols);
+	DisparityStatistics statistics;
+	ProcessDisparity(context.disparity16S, firstColumn-matchColumn, validThreshold16, disparityOffset, !haveValidRegions,
+		context.disparityCropped, maskValid8U, context.disparityHistogram, statistics);
+	disparity = context.disparityCropped;
+	pointCloud.trimLeft = firstColumn+regionLeft.x;
+	pointCloud.trimRight = halfWidth-(regionLeft.x+regionLeft.width);
+	pointCloud.trimTop = regionLeft.y;
+	pointCloud.trimBottom = image.rows-(regionLeft.y+regionLeft.height);
+	minVal = statistics.minDisparity;
+	maxVal = statistics.maxDisparity;
+	meanDisparity = statistics.meanDisparity;
+
+	// keep the range of matcher disparities (without the trim compensation) and the mean that decided the first column
+	// kept for the next frame of a sequence
+	context.havePriorDisparity = statistics.count > 0;
+	context.priorMinDisparity = (int)floor(minVal) - disparityOffset;
+	context.priorMaxDisparity = (int)ceil(maxVal) - disparityOffset;
+	context.priorMeanDisparity = firstMeanDisparity;
+
+	// tabulate the reprojection (Q) terms of every fixed-point disparity in the map, up to the maximum
+	Mat_<double> q;
+	cameraMatrix.Q.convertTo(q, CV_64F);
+	vector<Vec4d> &reprojectionTable = context.reprojectionTable;
+	BuildReprojectionTable(q, statistics.count > 0 ? cvRound(maxVal*16.) : 0, reprojectionTable);
+
+	// compute MIN distance in world coordinates (from MAXimum disparity) corrected for water density
+	pointCloud.minDistance = TableDistance(reprojectionTable, (float) maxVal, waterRefractionIndex);
 
 	// compute MAX distance in world coordinates (from MINimum disparity)
-	pointMatrix.at<float>(0,0) = (float) minVal;
-	reprojectImageTo3D(pointMatrix, pointMatrix3D, cameraMatrix.Q);
-	pointCloud.maxDistance = pointMatrix3D.at<Vec3f>(0,0)[2] * waterRefractionIndex;	// correct for water density
+	pointCloud.maxDistance = TableDistance(reprojectionTable, (float) minVal, waterRefractionIndex);
 
 	// compute mean distance in world coordinates
-	pointMatrix.at<float>(0,0) =  meanDisparity;
-	reprojectImageTo3D(pointMatrix, pointMatrix3D, cameraMatrix.Q);
-	pointCloud.meanDistance = pointMatrix3D.at<Vec3f>(0,0)[2] * waterRefractionIndex;	// correct for water density
-
-	// generate 3D point cloud from disparity map and correct for water density (adjust Z value only)
-	reprojectImageTo3D(disparity, pointCloud.data, cameraMatrix.Q);
-	vector<Mat> pointCloudChannels;
-	split(pointCloud.data, pointCloudChannels);
-	pointCloudChannels[2] = pointCloudChannels[2] * waterRefractionIndex;
-	merge(pointCloudChannels, pointCloud.data);
-
-	// get x and y range of 3D world coordinates of cloud
-	minMaxLoc(pointCloudChannels[0], &minVal, &maxVal, 0, 0, maskValid8U);
-	pointCloud.minX3D = (float) minVal;
-	pointCloud.maxX3D = (float) maxVal;
-	minMaxLoc(pointCloudChannels[1], &minVal, &maxVal, 0, 0, maskValid8U);
-	pointCloud.minY3D = (float) minVal;
-	pointCloud.maxY3D = (float) maxVal;
+	pointCloud.meanDistance = TableDistance(reprojectionTable, meanDisparity, waterRefractionIndex);
+
+	// compute median distance in world coordinates (robust to patches of bad matches)
+	pointCloud.medianDistance = TableDistance(reprojectionTable, statistics.medianDisparity, waterRefractionIndex);
+
+	// generate 3D point cloud from disparity map corrected for water density (Z value only) and get the x and
+	// y range of its 3D world coordinates, in a single pass
+	PointCloudRange range;
+	ReprojectDisparity(disparity, q, reprojectionTable, waterRefractionIndex, context.pointCloud, range);
+	pointCloud.data = context.pointCloud;
+	pointCloud.minX3D = range.minX3D;
+	pointCloud.maxX3D = range.maxX3D;
+	pointCloud.minY3D = range.minY3D;
+	pointCloud.maxY3D = range.maxY3D;
 
 	// display the disparity map
 	if (displayImage)
 	{
-		// display source image
-		imshow("Input", image);
+		// display source image (the matched regions)
+		Mat imageInput;
+		hconcat(imageLeft, imageRight, imageInput);
+		imshow("Input", imageInput);
 
 		// trim off left region where there is no disparity as well as the region where data is poor due to lens distortion
 		//Mat disparityTemp = disparity(Rect((int)meanDisparity+trim, trim, disparity.cols-(int)meanDisparity-trim, disparity.rows-(2*trim))).clone();
 		Mat disparityTemp = disparity;
 
-		// compute the max and min disparity values for image intensity scaling
-		threshold(disparityTemp, maskValid, 0.0, 1.0, THRESH_TOZERO);	// mask values at valid pixels are 1, otherwise 0
-		maskValid.convertTo(maskValid8U, CV_8UC1);
-		minMaxLoc(disparityTemp, &minVal, &maxVal, 0, 0, maskValid8U);	// mask must be type CV_8UC1
+		// the max and min disparity values for image intensity scaling
+		minVal = statistics.minDisparity;
+		maxVal = statistics.maxDisparity;
 		
 		// display as a normalized grayscale image with values 0 to 255
 		Mat imageDisparity8U;
 		double scale = 255./(maxVal-minVal);
-		disparityTemp.convertTo(imageDisparity8U, CV_8UC1, scale, -minVal*scale);
+		disparityTemp.convertTo(imageDisparity8U, CV_8UC1, scale/16., -minVal*scale);
 		imshow("Disparity", imageDisparity8U);
 		if (pauseForKeystroke)
 		{
@@ -212,3 +350,239 @@ void triangle(Mat matrix, Point p1, Point p2, Point p3, Scalar fillValue)
 	int npt[] = {3};
 	fillPoly(matrix, ppt, npt, 1, fillValue);
 }
+
+
+// A narrowed search range is inconsistent with the scene if few pixels matched or if many of the matches are
+// crowded against either end of the range (the true disparities of those pixels are likely outside of it),
+// where an end that is also an end of the full range does not count
+static bool DisparityWindowIsConsistent(const Mat &disparity16S, int minDisparity, int nDisparities, int fullDisparities)
+{
+	double minValidFraction = 0.25;		// fraction of the matchable pixels that must have a valid disparity
+	double maxEdgeFraction = 0.02;		// fraction of the valid pixels allowed at either end of the range
+	int edge = 2*16;					// width of the ends of the range (2 pixels in 1/16 pixel units)
+
+	int low = minDisparity*16, high = (minDisparity+nDisparities-1)*16;
+	int lowEdge = minDisparity > 0 ? low+edge : low;
+	int highEdge = minDisparity+nDisparities < fullDisparities ? high-edge : high;
+	int firstColumn = min(minDisparity+nDisparities, disparity16S.cols);	// columns left of this never match
+	int nValid = 0, nEdge = 0;
+	for (int y=0; y<disparity16S.rows; y++)
+	{
+		const short *d = disparity16S.ptr<short>(y);
+		for (int x=firstColumn; x<disparity16S.cols; x++)
+			if (d[x] >= low)
+			{
+				nValid++;
+				if (d[x] < lowEdge || d[x] > highEdge)
+					nEdge++;
+			}
+	}
+
+	int nTotal = disparity16S.rows * (disparity16S.cols - firstColumn);
+	return nValid > minValidFraction * nTotal && nEdge <= maxEdgeFraction * nValid;
+}
+
+
+// Low and high percentiles (tailFraction of the samples below and above) of the intensities of two 16-bit unsigned
+// images, from a histogram of every 4th pixel of every 4th row of both (all channels)
+static void IntensityPercentiles(const Mat &image1, const Mat &image2, double tailFraction, vector<int> &histogram,
+	double &low, double &high)
+{
+	int sampleStep = 4;
+	histogram.assign(65536, 0);
+	int count = 0;
+	const Mat *images[2] = {&image1, &image2};
+	for (int i=0; i<2; i++)
+	{
+		int cn = images[i]->channels();
+		for (int y=0; y<images[i]->rows; y+=sampleStep)
+		{
+			const ushort *p = images[i]->ptr<ushort>(y);
+			for (int x=0; x<images[i]->cols; x+=sampleStep)
+				for (int c=0; c<cn; c++)
+					histogram[p[x*cn + c]]++;
+			count += ((images[i]->cols + sampleStep - 1) / sampleStep) * cn;
+		}
+	}
+
+	// walk in from each end until the tail is passed
+	int nTail = (int)(tailFraction * count);
+	int lowValue = 0, highValue = 65535, n = 0;
+	for (lowValue=0; lowValue<65535; lowValue++)
+		if ((n += histogram[lowValue]) > nTail)
+			break;
+	n = 0;
+	for (highValue=65535; highValue>lowValue; highValue--)
+		if ((n += histogram[highValue]) > nTail)
+			break;
+	low = lowValue;
+	high = highValue;
+}
+
+
+// mean of the valid disparities of the raw (16 * pixel) matcher output, in pixels with the trim compensation
+static float MeanValidDisparity(const Mat &disparity16S, int validThreshold16, int trim)
+{
+	long long sum = 0;
+	int count = 0;
+	for (int y=0; y<disparity16S.rows; y++)
+	{
+		const short *d = disparity16S.ptr<short>(y);
+		for (int x=0; x<disparity16S.cols; x++)
+			if (d[x] > validThreshold16)
+			{
+				sum += d[x];
+				count++;
+			}
+	}
+	return count > 0 ? (float)((double)sum / (16.*count) + trim) : 0.f;
+}
+
+
+// A single pass over the raw (16 * pixel) matcher output right of firstColumn, which adds the trim compensation to
+// the valid disparities (keeping them in 16 * pixel units) and sets the invalid ones and, if maskCorner is set, those in
+// the corner triangle (0,0)-(0,250)-(150,0) to -1 pixel (-16), makes the mask of valid pixels, and accumulates the count, sum, range and histogram of the valid disparities
+static void ProcessDisparity(const Mat &disparity16S, int firstColumn, int validThreshold16, int trim, bool maskCorner, Mat &disparity,
+	Mat &mask, vector<int> &histogram, DisparityStatistics &statistics)
+{
+	int rows = disparity16S.rows, cols = disparity16S.cols - firstColumn;
+	disparity.create(rows, cols, CV_16SC1);
+	mask.create(rows, cols, CV_8UC1);
+	histogram.assign(32768, 0);
+
+	long long sum = 0;
+	int count = 0, minValue = SHRT_MAX, maxValue = SHRT_MIN;
+	for (int y=0; y<rows; y++)
+	{
+		const short *d = disparity16S.ptr<short>(y) + firstColumn;
+		short *out = disparity.ptr<short>(y);
+		uchar *m = mask.ptr<uchar>(y);
+
+		// pixels left of the hypotenuse of the corner triangle (250*x + 150*y <= 250*150) are masked
+		int xCorner = maskCorner && y <= 250 ? min(cols, (250*150 - 150*y) / 250 + 1) : 0;
+		for (int x=0; x<xCorner; x++)
+		{
+			out[x] = -16;
+			m[x] = 0;
+		}
+		for (int x=xCorner; x<cols; x++)
+		{
+			int v = d[x];
+			if (v > validThreshold16)
+			{
+				out[x] = (short)(v + 16*trim);
+				m[x] = 255;
+				sum += v;
+				count++;
+				minValue = min(minValue, v);
+				maxValue = max(maxValue, v);
+				histogram[v]++;
+			}
+			else
+			{
+				out[x] = -16;
+				m[x] = 0;
+			}
+		}
+	}
+
+	// the median is the first histogram value reaching half the count
+	int median = 0;
+	if (count > 0)
+	{
+		int n = 0;
+		for (median=minValue; median<=maxValue; median++)
+			if ((n += histogram[median]) * 2 >= count)
+				break;
+	}
+
+	statistics.count = count;
+	statistics.minDisparity = count > 0 ? minValue/16.f + trim : 0.f;
+	statistics.maxDisparity = count > 0 ? maxValue/16.f + trim : 0.f;
+	statistics.meanDisparity = count > 0 ? (float)((double)sum / (16.*count) + trim) : 0.f;
+	statistics.medianDisparity = count > 0 ? median/16.f + trim : 0.f;
+}
+
+
+// Table of the reprojection terms of the fixed-point disparities -16 (unmatched, -1 pixel) to maxDisparity16, where
+// entry i is for disparity d = (i-16)/16 pixels and holds 1/W, Z (at pixel (0,0), before the water correction) and
+// the disparity terms of X and Y, with (X Y Z W) = Q * (x y d 1) as in reprojectImageTo3D
+static void BuildReprojectionTable(const Mat_<double> &q, int maxDisparity16, vector<Vec4d> &table)
+{
+	table.resize(maxDisparity16 + 18);		// one extra entry to interpolate at the maximum
+	for (int i=0; i<(int)table.size(); i++)
+	{
+		double d = (i - 16) / 16.;
+		double iW = 1. / (q(3,2)*d + q(3,3));
+		table[i] = Vec4d(iW, (q(2,2)*d + q(2,3))*iW, q(0,2)*d, q(1,2)*d);
+	}
+}
+
+
+// distance in world coordinates of a disparity in pixels, corrected for water density (interpolated between
+// table entries for disparities such as the mean that are not a multiple of 1/16 pixel)
+static float TableDistance(const vector<Vec4d> &table, float disparity, float waterRefractionIndex)
+{
+	double position = disparity*16. + 16.;
+	int i = min(max((int)floor(position), 0), (int)table.size()-2);
+	double fraction = position - i;
+	double Z = table[i][1] + fraction*(table[i+1][1] - table[i][1]);
+	return (float) Z * waterRefractionIndex;
+}
+
+
+// Reprojects a fixed-point (16 * pixel) disparity map to a 3 channel (x,y,z) point cloud like reprojectImageTo3D,
+// and in the same pass multiplies Z by the water refraction index and finds the x and y range of the valid
+// (non-negative disparity) points. The disparity terms come from the table when Q has the form computed by
+// stereoRectify (W and Z depend on the disparity only), which removes the division from the per pixel work.
+static void ReprojectDisparity(const Mat &disparity, const Mat_<double> &q, const vector<Vec4d> &table, float waterRefractionIndex,
+	Mat &pointCloud, PointCloudRange &range)
+{
+	int rows = disparity.rows, cols = disparity.cols;
+	pointCloud.create(rows, cols, CV_32FC3);
+	bool tabulated = q(2,0) == 0. && q(2,1) == 0. && q(3,0) == 0. && q(3,1) == 0.;
+	double q00 = q(0,0), q10 = q(1,0), q20 = q(2,0), q30 = q(3,0);
+
+	float minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX;
+	for (int y=0; y<rows; y++)
+	{
+		const short *d = disparity.ptr<short>(y);
+		Vec3f *point = pointCloud.ptr<Vec3f>(y);
+		double qx = q(0,1)*y + q(0,3), qy = q(1,1)*y + q(1,3);
+		double qz = q(2,1)*y + q(2,3), qw = q(3,1)*y + q(3,3);
+		if (tabulated)
+		{
+			for (int x=0; x<cols; x++, qx += q00, qy += q10)
+			{
+				const Vec4d &t = table[d[x] + 16];
+				point[x] = Vec3f((float)((qx + t[2])*t[0]), (float)((qy + t[3])*t[0]), (float)t[1] * waterRefractionIndex);
+			}
+		}
+		else
+		{
+			for (int x=0; x<cols; x++, qx += q00, qy += q10, qz += q20, qw += q30)
+			{
+				double dx = d[x] * (1./16.);
+				double iW = 1. / (qw + q(3,2)*dx);
+				point[x] = Vec3f((float)((qx + q(0,2)*dx)*iW), (float)((qy + q(1,2)*dx)*iW),
+					(float)((qz + q(2,2)*dx)*iW) * waterRefractionIndex);
+			}
+		}
+		for (int x=0; x<cols; x++)
+			if (d[x] >= 0)
+			{
+				minX = min(minX, point[x][0]);
+				maxX = max(maxX, point[x][0]);
+				minY = min(minY, point[x][1]);
+				maxY = max(maxY, point[x][1]);
+			}
+	}
+
+	// an empty cloud has a zero range, as from minMaxLoc with an empty mask
+	if (minX > maxX)
+		minX = maxX = minY = maxY = 0.f;
+	range.minX3D = minX;
+	range.maxX3D = maxX;
+	range.minY3D = minY;
+	range.maxY3D = maxY;
+}
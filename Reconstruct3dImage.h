@@ -9,12 +9,15 @@
 #ifndef Reconstruct3dImage_H_
 #define Reconstruct3dImage_H_
 
+#include "GlobalDefines.h"
 #include "StereoStructDefines.h"
 #include <opencv2/core/core.hpp>
 
 #include <vector>
 
-PointCloud Reconstruct3dImage(cv::Mat image, CameraMatrix cameraMatrix, bool displayImage=false, bool pauseForKeystroke=false);
+PointCloud Reconstruct3dImage(cv::Mat image, const CameraMatrix &cameraMatrix, ReconstructionContext &context,
+	const Parameters &parameter,
+	bool displayImage=false, bool pauseForKeystroke=false);
 void triangle(cv::Mat matrix, cv::Point p1, cv::Point p2, cv::Point p3, cv::Scalar fillValue);
 
 #endif
\ No newline at end of file
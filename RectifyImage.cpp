@@ -7,14 +7,25 @@
 //          M1, D1, etc.      Camera calibration matrices                        //
 //          displayImage      A boolean option to display images as processed    //
 //          pauseForKeystroke A boolean option to pause if image is displayed    //
+//          validRegionsOnly  Only remap the valid regions of the calibration    //
+//                            (the rest of the pair is left black)               //
 // Output:  returned value    A rectified joined image pair                      //
 //                                                                               //
+// RectifyBayerImage does the same for a raw (CFA) image pair, demosaicing only  //
+// the pixels the rectification samples.                                         //
+//                                                                               //
+// The undistort/rectify maps only depend on the calibration and the image       //
+// size, so they are built once and kept in a cache shared by all callers. The   //
+// cache holds the maps of a few calibrations and sizes, dropping the least      //
+// recently used ones beyond that.                                               //
+//                                                                               //
 // Author:                    Peter Honig, phonig@whoi.edu, March 1 2015         //
 //                            (based on an example from the OpenCV site)         //
 //                                                                               //
 //===============================================================================//
 
 #include "RectifyImage.h"
+#include "demosaic.hpp"
 
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -24,11 +35,88 @@
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <utility>
 
 using namespace cv;
 using namespace std;
 
-Mat RectifyImage(Mat image, CameraMatrix cameraMatrix, bool displayImage, bool pauseForKeystroke)
+// cache of rectification maps keyed by calibration fingerprint and image size, where each full frame set of maps
+// takes several times the memory of a frame, so only the most recently used few are kept
+typedef pair<unsigned long long, pair<int, int> > RectificationMapKey;
+struct CachedRectificationMaps
+{
+	RectificationMaps maps;
+	unsigned long long lastUse;
+} ;
+static const size_t maxCachedRectificationMaps = 4;
+static map<RectificationMapKey, CachedRectificationMaps> rectificationMapCache;
+static unsigned long long rectificationMapUseCount = 0;
+static Mutex rectificationMapMutex;
+
+// add maps to the cache, dropping the least recently used maps if it is full (called with the lock held); maps
+// that were handed out stay valid, as the callers share the data
+static map<RectificationMapKey, CachedRectificationMaps>::iterator CacheRectificationMaps(const RectificationMapKey &key,
+	const RectificationMaps &maps)
+{
+	CachedRectificationMaps &cached = rectificationMapCache[key];
+	cached.maps = maps;
+	cached.lastUse = ++rectificationMapUseCount;
+	while (rectificationMapCache.size() > maxCachedRectificationMaps)
+	{
+		map<RectificationMapKey, CachedRectificationMaps>::iterator oldest = rectificationMapCache.begin();
+		for (map<RectificationMapKey, CachedRectificationMaps>::iterator it=rectificationMapCache.begin(); it!=rectificationMapCache.end(); ++it)
+			if (it->second.lastUse < oldest->second.lastUse)
+				oldest = it;
+		rectificationMapCache.erase(oldest);
+	}
+	return rectificationMapCache.find(key);
+}
+
+// display a rectified pair side by side with epipolar lines
+static void DisplayRectifiedPair(Mat imageLeftRectified, Mat imageRightRectified, bool pauseForKeystroke)
+{
+	// create a display canvas
+	Mat canvas, imageTemp;
+	int w, h;
+	double sf = 0.5;	// scale factor for display
+	Size imageSize = imageLeftRectified.size();
+	w = cvRound(imageSize.width*sf);
+	h = cvRound(imageSize.height*sf);
+	canvas.create(h, w*2, CV_8UC3);
+
+	imageTemp = imageLeftRectified.clone();
+	if (imageTemp.channels() == 1)
+		cvtColor(imageTemp, imageTemp, CV_GRAY2BGR);
+	if (imageTemp.type() != CV_8UC3)
+		imageTemp.convertTo(imageTemp, CV_8UC3, 1.0/256.0);
+	Mat canvasPart = canvas(Rect(w*0, 0, w, h));
+	resize(imageTemp, canvasPart, canvasPart.size(), 0, 0, CV_INTER_AREA);
+
+	imageTemp = imageRightRectified.clone();
+	if (imageTemp.channels() == 1)
+		cvtColor(imageTemp, imageTemp, CV_GRAY2BGR);
+	if (imageTemp.type() != CV_8UC3)
+		imageTemp.convertTo(imageTemp, CV_8UC3, 1.0/256.0);
+	canvasPart = canvas(Rect(w*1, 0, w, h));
+	resize(imageTemp, canvasPart, canvasPart.size(), 0, 0, CV_INTER_AREA);
+
+	// draw epipolar lines
+	for (int j=0; j<canvas.rows; j+=16)
+		line(canvas, Point(0, j), Point(canvas.cols, j), Scalar(0, 255, 0), 1, 8);
+
+	// display the rectified images with overlays
+	imshow("rectified", canvas);
+	if (pauseForKeystroke)
+	{
+		char c = (char)waitKey();
+		if( c == 27 || c == 'q' || c == 'Q' )	// allow for ESC or "q" to quit
+			exit (-1);
+	}
+}
+
+
+Mat RectifyImage(Mat image, const CameraMatrix &cameraMatrix, bool displayImage, bool pauseForKeystroke, bool validRegionsOnly)
 {
 	Mat imageLeft, imageRight, imageLeftRectified, imageRightRectified, imageRectified;
 
@@ -36,55 +124,158 @@ Mat RectifyImage(Mat image, CameraMatrix cameraMatrix, bool displayImage, bool p
 	imageLeft = image(Rect(0, 0, image.cols/2, image.rows)).clone();
 	imageRight = image(Rect(image.cols/2, 0, image.cols/2, image.rows)).clone();
 
-	// precompute maps used to create undistorted rectified images
+	// get the (cached) maps used to create undistorted rectified images
 	Size imageSize = imageLeft.size();
-	Mat map11, map12, map21, map22;
-	initUndistortRectifyMap(cameraMatrix.M1, cameraMatrix.D1, cameraMatrix.R1, cameraMatrix.P1, imageSize, CV_16SC2, map11, map12);
-	initUndistortRectifyMap(cameraMatrix.M2, cameraMatrix.D2, cameraMatrix.R2, cameraMatrix.P2, imageSize, CV_16SC2, map21, map22);
+	RectificationMaps maps;
+	GetRectificationMaps(cameraMatrix, imageSize, maps);
 
-	// remap the original images into rectification space (note: can accept 8, 16, or 32 bit formats)
-	remap(imageLeft, imageLeftRectified, map11, map12, CV_INTER_LINEAR);
-	remap(imageRight, imageRightRectified, map21, map22, CV_INTER_LINEAR);
+	// remap the original images into rectification space (note: can accept 8, 16, or 32 bit formats),
+	// optionally only inside the valid regions
+	Rect validRoi1, validRoi2;
+	if (validRegionsOnly && GetValidRegions(cameraMatrix, imageSize, validRoi1, validRoi2))
+	{
+		imageLeftRectified = Mat::zeros(imageSize, image.type());
+		imageRightRectified = Mat::zeros(imageSize, image.type());
+		Mat imageLeftValid = imageLeftRectified(validRoi1), imageRightValid = imageRightRectified(validRoi2);
+		remap(imageLeft, imageLeftValid, maps.map11(validRoi1), maps.map12(validRoi1), CV_INTER_LINEAR);
+		remap(imageRight, imageRightValid, maps.map21(validRoi2), maps.map22(validRoi2), CV_INTER_LINEAR);
+	}
+	else
+	{
+		remap(imageLeft, imageLeftRectified, maps.map11, maps.map12, CV_INTER_LINEAR);
+		remap(imageRight, imageRightRectified, maps.map21, maps.map22, CV_INTER_LINEAR);
+	}
 
 	// combine left and right rectified images
 	hconcat (imageLeftRectified, imageRightRectified, imageRectified);
 
 	// display the rectified images
 	if (displayImage)
+		DisplayRectifiedPair(imageLeftRectified, imageRightRectified, pauseForKeystroke);
+
+	return (imageRectified);
+}
+
+
+Mat RectifyBayerImage(Mat image, const CameraMatrix &cameraMatrix, string cfaPattern, bool displayImage, bool pauseForKeystroke,
+	bool greenOnly, bool validRegionsOnly)
+{
+	// the halves are views into the joined CFA image, so the demosaic near the seam sees the
+	// same neighbors as a demosaic of the whole joined image would
+	int halfWidth = image.cols/2;
+	Mat imageLeft = image(Rect(0, 0, halfWidth, image.rows));
+	Mat imageRight = image(Rect(halfWidth, 0, halfWidth, image.rows));
+
+	// the right half starts on an odd column when the half width is odd, which swaps the pattern columns
+	string cfaPatternRight = cfaPattern;
+	if (halfWidth % 2 != 0)
+	{
+		swap(cfaPatternRight[0], cfaPatternRight[1]);
+		swap(cfaPatternRight[2], cfaPatternRight[3]);
+	}
+
+	// get the (cached) maps used to create undistorted rectified images
+	Size imageSize = imageLeft.size();
+	RectificationMaps maps;
+	GetRectificationMaps(cameraMatrix, imageSize, maps);
+
+	// demosaic only where the maps sample and write each rectified half straight into the joined output
+	// (optionally only the green channel, e.g. for matching)
+	int nChannels = greenOnly ? 1 : 3;
+	Mat imageRectified(image.rows, halfWidth*2, CV_MAKETYPE(image.depth(), nChannels));
+	Mat imageLeftRectified = imageRectified(Rect(0, 0, halfWidth, image.rows));
+	Mat imageRightRectified = imageRectified(Rect(halfWidth, 0, halfWidth, image.rows));
+	Rect validRoi1, validRoi2;
+	if (validRegionsOnly && GetValidRegions(cameraMatrix, imageSize, validRoi1, validRoi2))
 	{
-		// create a display canvas
-		Mat canvas, imageTemp;
-		int w, h;
-		double sf = 0.5;	// scale factor for display
-		w = cvRound(imageSize.width*sf);
-		h = cvRound(imageSize.height*sf);
-		canvas.create(h, w*2, CV_8UC3);
-
-		imageTemp = imageLeftRectified.clone();
-		if (imageTemp.type() != CV_8UC3)
-			imageTemp.convertTo(imageTemp, CV_8UC3, 1.0/256.0);
-		Mat canvasPart = canvas(Rect(w*0, 0, w, h));
-		resize(imageTemp, canvasPart, canvasPart.size(), 0, 0, CV_INTER_AREA);
-
-		imageTemp = imageRightRectified.clone();
-		if (imageTemp.type() != CV_8UC3)
-			imageTemp.convertTo(imageTemp, CV_8UC3, 1.0/256.0);
-		canvasPart = canvas(Rect(w*1, 0, w, h));
-		resize(imageTemp, canvasPart, canvasPart.size(), 0, 0, CV_INTER_AREA);
-
-		// draw epipolar lines
-		for (int j=0; j<canvas.rows; j+=16)
-			line(canvas, Point(0, j), Point(canvas.cols, j), Scalar(0, 255, 0), 1, 8);
-
-		// display the rectified images with overlays
-		imshow("rectified", canvas);
-		if (pauseForKeystroke)
-		{
-			char c = (char)waitKey();
-			if( c == 27 || c == 'q' || c == 'Q' )	// allow for ESC or "q" to quit
-				exit (-1);
-		}
+		imageRectified = Scalar::all(0);
+		Mat imageLeftValid = imageLeftRectified(validRoi1), imageRightValid = imageRightRectified(validRoi2);
+		demosaic_remap(imageLeft, imageLeftValid, maps.map11(validRoi1), maps.map12(validRoi1), cfaPattern, nChannels);
+		demosaic_remap(imageRight, imageRightValid, maps.map21(validRoi2), maps.map22(validRoi2), cfaPatternRight, nChannels);
+	}
+	else
+	{
+		demosaic_remap(imageLeft, imageLeftRectified, maps.map11, maps.map12, cfaPattern, nChannels);
+		demosaic_remap(imageRight, imageRightRectified, maps.map21, maps.map22, cfaPatternRight, nChannels);
 	}
 
+	// display the rectified images
+	if (displayImage)
+		DisplayRectifiedPair(imageLeftRectified, imageRightRectified, pauseForKeystroke);
+
 	return (imageRectified);
 }
+
+
+void GetRectificationMaps(const CameraMatrix &cameraMatrix, Size imageSize, RectificationMaps &maps)
+{
+	RectificationMapKey key(CameraMatrixFingerprint(cameraMatrix), make_pair(imageSize.width, imageSize.height));
+
+	// the lock is held while building so that concurrent callers never build the same maps twice
+	AutoLock lock(rectificationMapMutex);
+	map<RectificationMapKey, CachedRectificationMaps>::iterator it = rectificationMapCache.find(key);
+	if (it == rectificationMapCache.end())
+	{
+		RectificationMaps newMaps;
+		newMaps.imageSize = imageSize;
+		initUndistortRectifyMap(cameraMatrix.M1, cameraMatrix.D1, cameraMatrix.R1, cameraMatrix.P1, imageSize, CV_16SC2, newMaps.map11, newMaps.map12);
+		initUndistortRectifyMap(cameraMatrix.M2, cameraMatrix.D2, cameraMatrix.R2, cameraMatrix.P2, imageSize, CV_16SC2, newMaps.map21, newMaps.map22);
+		it = CacheRectificationMaps(key, newMaps);
+	}
+	else
+		it->second.lastUse = ++rectificationMapUseCount;
+
+	// the maps are never written after being built, so handing out shared headers is thread safe
+	maps = it->second.maps;
+}
+
+
+// the valid regions of the rectified images from the calibration, if it has them and they fit the image size
+bool GetValidRegions(const CameraMatrix &cameraMatrix, Size imageSize, Rect &validRoi1, Rect &validRoi2)
+{
+	Rect image(Point(0, 0), imageSize);
+	validRoi1 = cameraMatrix.validRoi1;
+	validRoi2 = cameraMatrix.validRoi2;
+	return validRoi1.area() > 0 && validRoi2.area() > 0 && (validRoi1 & image) == validRoi1 && (validRoi2 & image) == validRoi2;
+}
+
+
+void AddRectificationMaps(const CameraMatrix &cameraMatrix, const RectificationMaps &maps)
+{
+	// seed the cache with maps built elsewhere (e.g. precomputed at calibration time)
+	RectificationMapKey key(CameraMatrixFingerprint(cameraMatrix), make_pair(maps.imageSize.width, maps.imageSize.height));
+	AutoLock lock(rectificationMapMutex);
+	CacheRectificationMaps(key, maps);
+}
+
+
+// 64 bit FNV-1a hash of the calibration matrices that determine the rectification maps
+static void HashMatrix(unsigned long long &hash, const Mat &matrix)
+{
+	const unsigned long long prime = 1099511628211ULL;
+	int header[3] = {matrix.type(), matrix.rows, matrix.cols};
+	const uchar *bytes = (const uchar*)header;
+	for (size_t i=0; i<sizeof(header); i++)
+		hash = (hash ^ bytes[i]) * prime;
+	for (int iRow=0; iRow<matrix.rows; iRow++)
+	{
+		bytes = matrix.ptr(iRow);
+		for (size_t i=0; i<matrix.cols*matrix.elemSize(); i++)
+			hash = (hash ^ bytes[i]) * prime;
+	}
+}
+
+
+unsigned long long CameraMatrixFingerprint(const CameraMatrix &cameraMatrix)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	HashMatrix(hash, cameraMatrix.M1);
+	HashMatrix(hash, cameraMatrix.D1);
+	HashMatrix(hash, cameraMatrix.R1);
+	HashMatrix(hash, cameraMatrix.P1);
+	HashMatrix(hash, cameraMatrix.M2);
+	HashMatrix(hash, cameraMatrix.D2);
+	HashMatrix(hash, cameraMatrix.R2);
+	HashMatrix(hash, cameraMatrix.P2);
+	return hash;
+}
@@ -12,6 +12,15 @@
 #include "StereoStructDefines.h"
 #include <opencv2/core/core.hpp>
 
-cv::Mat RectifyImage(cv::Mat image, CameraMatrix cameraMatrix, bool displayImage=false, bool pauseForKeystroke=false);
+#include <string>
+
+cv::Mat RectifyImage(cv::Mat image, const CameraMatrix &cameraMatrix, bool displayImage=false, bool pauseForKeystroke=false,
+	bool validRegionsOnly=false);
+cv::Mat RectifyBayerImage(cv::Mat image, const CameraMatrix &cameraMatrix, std::string cfaPattern, bool displayImage=false, bool pauseForKeystroke=false,
+	bool greenOnly=false, bool validRegionsOnly=false);
+bool GetValidRegions(const CameraMatrix &cameraMatrix, cv::Size imageSize, cv::Rect &validRoi1, cv::Rect &validRoi2);
+void GetRectificationMaps(const CameraMatrix &cameraMatrix, cv::Size imageSize, RectificationMaps &maps);
+void AddRectificationMaps(const CameraMatrix &cameraMatrix, const RectificationMaps &maps);
+unsigned long long CameraMatrixFingerprint(const CameraMatrix &cameraMatrix);
 
 #endif
\ No newline at end of file
@@ -10,6 +10,10 @@
 #define StereoStructDefines_H_
 
 #include <opencv2/core/core.hpp>
+#include <opencv2/calib3d/calib3d.hpp>
+#include "CensusSGM.h"
+
+#include <vector>
 
 // definition of point cloud data output file formats
 enum FileFormat {PC_BINARY, PC_TEXT, PC_MESH, PC_MESH_TEXTURE};
@@ -20,6 +24,7 @@ struct PointCloud
 	float meanDistance;
 	float minDistance;
 	float maxDistance;
+	float medianDistance;
 	int trimLeft;
 	int trimRight;
 	int trimTop;
@@ -43,6 +48,62 @@ struct CameraMatrix
 	cv::Mat P1;
 	cv::Mat P2;
 	cv::Mat Q;
+
+	// regions of the rectified left and right images holding only valid pixels (empty if not calibrated)
+	cv::Rect validRoi1;
+	cv::Rect validRoi2;
+} ;
+
+// undistort/rectify maps for the left (map11, map12) and right (map21, map22) cameras
+struct RectificationMaps
+{
+	cv::Mat map11;
+	cv::Mat map12;
+	cv::Mat map21;
+	cv::Mat map22;
+	cv::Size imageSize;
+} ;
+
+// stereo matcher and intermediate images kept alive from frame to frame so their
+// memory (including the matcher's cost buffers) is reused when the sizes match
+struct ReconstructionContext
+{
+	ReconstructionContext() : havePriorDisparity(false), priorMinDisparity(0), priorMaxDisparity(0), priorMeanDisparity(0.f) {}
+
+	cv::StereoSGBM sgbm;
+	std::vector<int> intensityHistogram;
+	cv::Mat imageLeft;
+	cv::Mat imageRight;
+	cv::Mat disparity16S;
+	cv::Mat disparityCropped;
+	cv::Mat maskValid8U;
+	std::vector<int> disparityHistogram;
+	cv::Mat pointCloud;
+
+	// reprojection terms of each 16-bit fixed-point disparity (inverse W, Z, and the disparity terms of X and Y)
+	std::vector<cv::Vec4d> reprojectionTable;
+
+	// census semi-global matcher used instead of StereoSGBM if selected
+	CensusSGM census;
+
+	// matchers and disparity buffers of the strips of a frame matched in parallel
+	std::vector<cv::StereoSGBM> stripMatchers;
+	std::vector<CensusSGM> stripCensus;
+	std::vector<cv::Mat> stripDisparities;
+	cv::Mat disparityReference;
+
+	// disparity range of the previous frame (in matcher units), used to narrow the search of the next one
+	bool havePriorDisparity;
+	int priorMinDisparity;
+	int priorMaxDisparity;
+	float priorMeanDisparity;		// in pixels with the trim compensation
+
+	// reduced resolution matching used to estimate the disparity range of a frame
+	cv::StereoSGBM sgbmCoarse;
+	cv::Mat coarseTemp;
+	cv::Mat coarseLeft;
+	cv::Mat coarseRight;
+	cv::Mat coarseDisparity;
 } ;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+//===============================================================================//
+//                                                                               //
+// A pool of worker threads that shares a list of independent items (frames)     //
+// between them. Each worker works through its own block of the list in order    //
+// and, once that is done, steals items from the end of the block with the most  //
+// left, so all the workers stay busy until the end even when some items take    //
+// much longer than others.                                                      //
+//                                                                               //
+//===============================================================================//
+
+#include "WorkStealingPool.h"
+
+#include <thread>
+#include <algorithm>
+
+using namespace std;
+
+
+WorkStealingPool::WorkStealingPool(int workerCount) : workerCount(max(workerCount, 1)), queues(max(workerCount, 1)),
+	queueMutexes(max(workerCount, 1))
+{
+}
+
+
+void WorkStealingPool::Run(int nItems, const function<void(int, int)> &task)
+{
+	// give each worker a contiguous block of the items
+	for (int w=0; w<workerCount; w++)
+	{
+		queues[w].clear();
+		for (int i=(int)((long long)nItems*w/workerCount); i<(int)((long long)nItems*(w+1)/workerCount); i++)
+			queues[w].push_back(i);
+	}
+
+	// no items are added while running, so a worker is done when it finds nothing left anywhere
+	vector<thread> workers;
+	for (int w=0; w<workerCount; w++)
+		workers.push_back(thread([this, w, &task]()
+		{
+			int item;
+			while (NextItem(w, item))
+				task(w, item);
+		}));
+	for (int w=0; w<workerCount; w++)
+		workers[w].join();
+}
+
+
+// the next item from the front of the worker's own block, or else from the back of the largest other block
+bool WorkStealingPool::NextItem(int worker, int &item)
+{
+	{
+		lock_guard<mutex> lock(queueMutexes[worker]);
+		if (!queues[worker].empty())
+		{
+			item = queues[worker].front();
+			queues[worker].pop_front();
+			return true;
+		}
+	}
+	while (true)
+	{
+		int victim = -1;
+		size_t most = 0;
+		for (int w=0; w<workerCount; w++)
+		{
+			lock_guard<mutex> lock(queueMutexes[w]);
+			if (queues[w].size() > most)
+			{
+				most = queues[w].size();
+				victim = w;
+			}
+		}
+		if (victim < 0)
+			return false;
+		lock_guard<mutex> lock(queueMutexes[victim]);
+		if (!queues[victim].empty())		// it may have been emptied since it was looked at
+		{
+			item = queues[victim].back();
+			queues[victim].pop_back();
+			return true;
+		}
+	}
+}
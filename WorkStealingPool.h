@@ -0,0 +1,34 @@
+//===============================================================================//
+//                                                                               //
+// Header for WorkStealingPool.cpp                                               //
+//                                                                               //
+//===============================================================================//
+
+#ifndef WorkStealingPool_H_
+#define WorkStealingPool_H_
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <functional>
+
+// runs a task for each of a number of items on a fixed number of worker threads, where each worker starts with a
+// contiguous block of the items and takes items from the end of the busiest other block once its own is done
+class WorkStealingPool
+{
+public:
+	explicit WorkStealingPool(int workerCount);
+	int WorkerCount() const {return workerCount;}
+
+	// calls task(worker, item) once for each item 0 to nItems-1 and returns when all are done
+	void Run(int nItems, const std::function<void(int, int)> &task);
+
+private:
+	bool NextItem(int worker, int &item);
+
+	int workerCount;
+	std::vector<std::deque<int> > queues;
+	std::vector<std::mutex> queueMutexes;
+};
+
+#endif
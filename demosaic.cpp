@@ -1,169 +1,843 @@
 #include <opencv2/opencv.hpp>
 #include <boost/algorithm/string.hpp>
 #include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <climits>
 #include "demosaic.hpp"
 
+// the 16 bit kernels are written for SSE2 when the compiler targets it
+// (always the case for x86-64)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DEMOSAIC_SSE2
+#endif
+
+// the per-site filters must be inlined into the span loops, which gcc
+// stops doing on its own once they have many instances
+#if defined(_MSC_VER)
+#define DEMOSAIC_INLINE __forceinline
+#elif defined(__GNUC__)
+#define DEMOSAIC_INLINE inline __attribute__((always_inline))
+#else
+#define DEMOSAIC_INLINE inline
+#endif
+
 using namespace cv;
 using namespace std;
 
-// create a kernel for the given CFA channel
-// given the name of the Bayer pattern
-Mat cfa_kern(string cfa, char chan) {
-  int A = cfa[0]==chan;
-  int B = cfa[1]==chan;
-  int C = cfa[2]==chan;
-  int D = cfa[3]==chan;
-  return (Mat_<uchar>(2,2) <<
-	  A, B,
-	  C, D);
-}
-
-// utils for producing kernels for R, G, and B channels
-Mat r_kern(string cfa) {
-  return cfa_kern(cfa,'r');
-}
-Mat g_kern(string cfa) {
-  return cfa_kern(cfa,'g');
-}
-Mat b_kern(string cfa) {
-  return cfa_kern(cfa,'b');
-}
-
-// kernel generation for
-// R at G, R row as well as B at G, B col
-Mat ratg_rrow_kern(string cfa) {
-  int A = cfa[0]=='g' && cfa[1]=='r';
-  int B = cfa[1]=='g' && cfa[0]=='r';
-  int C = cfa[2]=='g' && cfa[3]=='r';
-  int D = cfa[3]=='g' && cfa[2]=='r';
-  return (Mat_<uchar>(2,2) <<
-	  A, B,
-	  C, D);
-}
-
-// kernel generation for
-// R at G, R col as well as B at G, B row
-Mat ratg_rcol_kern(string cfa) {
-  int A = cfa[0]=='g' && cfa[2]=='r';
-  int B = cfa[1]=='g' && cfa[3]=='r';
-  int C = cfa[2]=='g' && cfa[0]=='r';
-  int D = cfa[3]=='g' && cfa[1]=='r';
-  return (Mat_<uchar>(2,2) <<
-	  A, B,
-	  C, D);
+// Bayer site classes, i.e. which Malvar filters a CFA site needs
+enum { SITE_R, SITE_B, SITE_G_RROW, SITE_G_BROW };
+
+// classify one of the four sites (0..3, row-major within the 2x2 cell)
+// of a (lowercase) Bayer pattern
+static int cfa_site_class(const string& cfa, int site) {
+  if(cfa[site]=='r') return SITE_R;
+  if(cfa[site]=='b') return SITE_B;
+  // G site; its horizontal neighbor tells whether it sits in an R or B row
+  return cfa[site^1]=='r' ? SITE_G_RROW : SITE_G_BROW;
+}
+
+// rows of tiled (cache-blocked) work handed to the fused kernel at a time
+static const int DEMOSAIC_BAND_ROWS = 32;
+
+// rows of destination per band of demosaic_remap, taller than the other
+// bands because the source region a band demosaics overlaps the regions
+// of its neighbors by the vertical spread of the map
+static const int REMAP_BAND_ROWS = 64;
+
+// maximum number of threads used within one call (0 = OpenCV's default)
+static int demosaic_num_threads = 0;
+
+void demosaic_set_num_threads(int nthreads) {
+  demosaic_num_threads = nthreads < 0 ? 0 : nthreads;
+}
+
+int demosaic_get_num_threads() {
+  return demosaic_num_threads;
+}
+
+// run a loop body over [0,n) honoring the thread-count setting. each
+// stripe is processed by a single thread, so limiting the stripe count
+// limits how many threads work on one call.
+static void run_parallel(int n, const ParallelLoopBody& body) {
+  if(n <= 0)
+    return;
+  if(demosaic_num_threads == 1 || n == 1) {
+    body(Range(0, n));
+  } else {
+    parallel_for_(Range(0, n), body, demosaic_num_threads > 0 ? (double)demosaic_num_threads : -1.);
+  }
+}
+
+// number of bands needed to cover a number of rows
+static int band_count(int rows) {
+  return (rows + DEMOSAIC_BAND_ROWS - 1) / DEMOSAIC_BAND_ROWS;
+}
+
+// Malvar et al's filters evaluated at a single site of class CLS. r
+// points at the five source rows y-2..y+2 and x is the column. All
+// three outputs are scaled by 16 so every coefficient is an integer.
+template<int CLS, typename WT, typename T>
+static DEMOSAIC_INLINE void malvar_site(const T* const* r, int x, WT bgr[3]) {
+  const T* r0 = r[0];
+  const T* r1 = r[1];
+  const T* r2 = r[2];
+  const T* r3 = r[3];
+  const T* r4 = r[4];
+  WT c = (WT)r2[x];
+  WT axis1h = (WT)r2[x-1] + (WT)r2[x+1];
+  WT axis1v = (WT)r1[x] + (WT)r3[x];
+  WT axis2h = (WT)r2[x-2] + (WT)r2[x+2];
+  WT axis2v = (WT)r0[x] + (WT)r4[x];
+  WT diag = (WT)r1[x-1] + (WT)r1[x+1] + (WT)r3[x-1] + (WT)r3[x+1];
+  if(CLS == SITE_R || CLS == SITE_B) {
+    // G at R/B locations and B/R at R/B locations
+    WT g = 8*c + 4*(axis1h + axis1v) - 2*(axis2h + axis2v);
+    WT rb = 12*c + 4*diag - 3*(axis2h + axis2v);
+    bgr[1] = g;
+    bgr[0] = CLS==SITE_R ? rb : 16*c;
+    bgr[2] = CLS==SITE_R ? 16*c : rb;
+  } else {
+    // R/B at G in an R/B row (horizontal neighbors) and column (vertical neighbors)
+    WT row = 10*c + 8*axis1h - 2*(axis2h + diag) + axis2v;
+    WT col = 10*c + 8*axis1v - 2*(axis2v + diag) + axis2h;
+    bgr[1] = 16*c;
+    bgr[2] = CLS==SITE_G_RROW ? row : col;
+    bgr[0] = CLS==SITE_G_RROW ? col : row;
+  }
+}
+
+// green only version of malvar_site, for single channel output
+template<int CLS, typename WT, typename T>
+static DEMOSAIC_INLINE WT malvar_site_green(const T* const* r, int x) {
+  WT c = (WT)r[2][x];
+  if(CLS == SITE_G_RROW || CLS == SITE_G_BROW)
+    return 16*c;
+  WT axis1 = (WT)r[2][x-1] + (WT)r[2][x+1] + (WT)r[1][x] + (WT)r[3][x];
+  WT axis2 = (WT)r[2][x-2] + (WT)r[2][x+2] + (WT)r[0][x] + (WT)r[4][x];
+  return 8*c + 4*axis1 - 2*axis2;
+}
+
+// the same filters for a site class only known at run time (borders and
+// single remap taps)
+template<typename WT, typename T>
+static inline void malvar_pixel(const T* const* r, int x, int cls, WT bgr[3]) {
+  switch(cls) {
+  case SITE_R: malvar_site<SITE_R>(r, x, bgr); break;
+  case SITE_B: malvar_site<SITE_B>(r, x, bgr); break;
+  case SITE_G_RROW: malvar_site<SITE_G_RROW>(r, x, bgr); break;
+  default: malvar_site<SITE_G_BROW>(r, x, bgr); break;
+  }
+}
+template<typename WT, typename T>
+static inline WT malvar_green(const T* const* r, int x, int cls) {
+  if(cls == SITE_G_RROW || cls == SITE_G_BROW)
+    return malvar_site_green<SITE_G_RROW,WT>(r, x);
+  return malvar_site_green<SITE_R,WT>(r, x);
+}
+
+// remove the scale of 16 from malvar_pixel output
+template<typename DT> static inline DT malvar_descale(float v) {
+  return saturate_cast<DT>(v * (1.f/16));
+}
+template<typename DT> static inline DT malvar_descale(double v) {
+  return saturate_cast<DT>(v * (1./16));
+}
+// fixed-point version: round to nearest and saturate
+template<typename DT> static inline DT malvar_descale(int v) {
+  return saturate_cast<DT>((v + 8) >> 4);
+}
+
+// evaluate and store one site of a known class as BGR (DCN 3) or green
+// only (DCN 1)
+template<int CLS, int DCN, typename WT, typename ST, typename DT>
+static DEMOSAIC_INLINE void malvar_store(const ST* const* r, DT* out, int x) {
+  if(DCN == 1) {
+    out[x] = malvar_descale<DT>(malvar_site_green<CLS,WT>(r, x));
+  } else {
+    WT bgr[3];
+    malvar_site<CLS>(r, x, bgr);
+    out[x*3] = malvar_descale<DT>(bgr[0]);
+    out[x*3+1] = malvar_descale<DT>(bgr[1]);
+    out[x*3+2] = malvar_descale<DT>(bgr[2]);
+  }
+}
+
+// vectorized spans, which only exist for 16 bit data (raw frames); they
+// return the column the scalar code continues from
+template<int C0, int C1, int DCN, typename ST, typename DT>
+static inline int malvar_span_simd(const ST* const*, DT*, int x, int) {
+  return x;
+}
+
+#ifdef DEMOSAIC_SSE2
+// the sums of malvar_site for four columns in 32-bit lanes
+struct malvar_sse2_sums {
+  __m128i c, axis1h, axis1v, axis2h, axis2v, diag;
+};
+
+// load eight 16 bit values as two vectors of four 32-bit lanes
+static inline void load_u16x8(const ushort* p, __m128i& lo, __m128i& hi) {
+  __m128i v = _mm_loadu_si128((const __m128i*)p);
+  lo = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+  hi = _mm_unpackhi_epi16(v, _mm_setzero_si128());
+}
+
+// malvar_site of class CLS in all four lanes; SSE2 has no 32-bit
+// multiply, so the coefficients are built from shifts and adds
+template<int CLS>
+static inline void malvar_site_sse2(const malvar_sse2_sums& s, __m128i bgr[3]) {
+  __m128i c16 = _mm_slli_epi32(s.c, 4);
+  if(CLS == SITE_R || CLS == SITE_B) {
+    __m128i axis2 = _mm_add_epi32(s.axis2h, s.axis2v);
+    __m128i g = _mm_sub_epi32(_mm_add_epi32(_mm_slli_epi32(s.c, 3), _mm_slli_epi32(_mm_add_epi32(s.axis1h, s.axis1v), 2)),
+			      _mm_slli_epi32(axis2, 1));
+    __m128i rb = _mm_sub_epi32(_mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(s.c, 3), _mm_slli_epi32(s.c, 2)), _mm_slli_epi32(s.diag, 2)),
+			       _mm_add_epi32(_mm_slli_epi32(axis2, 1), axis2));
+    bgr[1] = g;
+    bgr[0] = CLS==SITE_R ? rb : c16;
+    bgr[2] = CLS==SITE_R ? c16 : rb;
+  } else {
+    __m128i c10 = _mm_add_epi32(_mm_slli_epi32(s.c, 3), _mm_slli_epi32(s.c, 1));
+    __m128i row = _mm_add_epi32(_mm_sub_epi32(_mm_add_epi32(c10, _mm_slli_epi32(s.axis1h, 3)),
+					      _mm_slli_epi32(_mm_add_epi32(s.axis2h, s.diag), 1)), s.axis2v);
+    __m128i col = _mm_add_epi32(_mm_sub_epi32(_mm_add_epi32(c10, _mm_slli_epi32(s.axis1v, 3)),
+					      _mm_slli_epi32(_mm_add_epi32(s.axis2v, s.diag), 1)), s.axis2h);
+    bgr[1] = c16;
+    bgr[2] = CLS==SITE_G_RROW ? row : col;
+    bgr[0] = CLS==SITE_G_RROW ? col : row;
+  }
+}
+
+// descale, saturate and pack two vectors of four 32-bit lanes into eight
+// 16 bit values (SSE2 only packs with signed saturation, hence the bias)
+static inline __m128i malvar_descale_sse2(__m128i lo, __m128i hi) {
+  const __m128i round = _mm_set1_epi32(8), bias32 = _mm_set1_epi32(32768), bias16 = _mm_set1_epi16((short)0x8000);
+  lo = _mm_sub_epi32(_mm_srai_epi32(_mm_add_epi32(lo, round), 4), bias32);
+  hi = _mm_sub_epi32(_mm_srai_epi32(_mm_add_epi32(hi, round), 4), bias32);
+  return _mm_xor_si128(_mm_packs_epi32(lo, hi), bias16);
+}
+
+// eight columns of 16 bit data at a time, where the even lanes are sites
+// of class C0 and the odd lanes of class C1
+template<int C0, int C1, int DCN>
+static inline int malvar_span_simd(const ushort* const* r, ushort* out, int x, int x1) {
+  const __m128i even = _mm_set_epi32(0, -1, 0, -1);
+  if(DCN == 1) {
+    // green only: the green sites are copied, the red and blue sites need
+    // just the axis sums
+    const __m128i green = C0 == SITE_G_RROW || C0 == SITE_G_BROW ? even : _mm_xor_si128(even, _mm_set1_epi32(-1));
+    for(; x + 8 <= x1; x += 8) {
+      __m128i c[2], axis1[2], axis2[2], lo, hi, lo2, hi2;
+      load_u16x8(r[2] + x, c[0], c[1]);
+      load_u16x8(r[2] + x - 1, lo, hi);
+      load_u16x8(r[2] + x + 1, lo2, hi2);
+      axis1[0] = _mm_add_epi32(lo, lo2);
+      axis1[1] = _mm_add_epi32(hi, hi2);
+      load_u16x8(r[1] + x, lo, hi);
+      load_u16x8(r[3] + x, lo2, hi2);
+      axis1[0] = _mm_add_epi32(axis1[0], _mm_add_epi32(lo, lo2));
+      axis1[1] = _mm_add_epi32(axis1[1], _mm_add_epi32(hi, hi2));
+      load_u16x8(r[2] + x - 2, lo, hi);
+      load_u16x8(r[2] + x + 2, lo2, hi2);
+      axis2[0] = _mm_add_epi32(lo, lo2);
+      axis2[1] = _mm_add_epi32(hi, hi2);
+      load_u16x8(r[0] + x, lo, hi);
+      load_u16x8(r[4] + x, lo2, hi2);
+      axis2[0] = _mm_add_epi32(axis2[0], _mm_add_epi32(lo, lo2));
+      axis2[1] = _mm_add_epi32(axis2[1], _mm_add_epi32(hi, hi2));
+      __m128i v[2];
+      for(int half = 0; half < 2; half++) {
+	__m128i g = _mm_sub_epi32(_mm_add_epi32(_mm_slli_epi32(c[half], 3), _mm_slli_epi32(axis1[half], 2)),
+				  _mm_slli_epi32(axis2[half], 1));
+	v[half] = _mm_or_si128(_mm_and_si128(green, _mm_slli_epi32(c[half], 4)), _mm_andnot_si128(green, g));
+      }
+      _mm_storeu_si128((__m128i*)(out + x), malvar_descale_sse2(v[0], v[1]));
+    }
+    return x;
+  }
+  for(; x + 8 <= x1; x += 8) {
+    malvar_sse2_sums s[2];
+    __m128i lo, hi, lo2, hi2;
+    load_u16x8(r[2] + x, s[0].c, s[1].c);
+    load_u16x8(r[2] + x - 1, lo, hi);
+    load_u16x8(r[2] + x + 1, lo2, hi2);
+    s[0].axis1h = _mm_add_epi32(lo, lo2);
+    s[1].axis1h = _mm_add_epi32(hi, hi2);
+    load_u16x8(r[1] + x, lo, hi);
+    load_u16x8(r[3] + x, lo2, hi2);
+    s[0].axis1v = _mm_add_epi32(lo, lo2);
+    s[1].axis1v = _mm_add_epi32(hi, hi2);
+    load_u16x8(r[2] + x - 2, lo, hi);
+    load_u16x8(r[2] + x + 2, lo2, hi2);
+    s[0].axis2h = _mm_add_epi32(lo, lo2);
+    s[1].axis2h = _mm_add_epi32(hi, hi2);
+    load_u16x8(r[0] + x, lo, hi);
+    load_u16x8(r[4] + x, lo2, hi2);
+    s[0].axis2v = _mm_add_epi32(lo, lo2);
+    s[1].axis2v = _mm_add_epi32(hi, hi2);
+    load_u16x8(r[1] + x - 1, lo, hi);
+    load_u16x8(r[1] + x + 1, lo2, hi2);
+    s[0].diag = _mm_add_epi32(lo, lo2);
+    s[1].diag = _mm_add_epi32(hi, hi2);
+    load_u16x8(r[3] + x - 1, lo, hi);
+    load_u16x8(r[3] + x + 1, lo2, hi2);
+    s[0].diag = _mm_add_epi32(s[0].diag, _mm_add_epi32(lo, lo2));
+    s[1].diag = _mm_add_epi32(s[1].diag, _mm_add_epi32(hi, hi2));
+
+    // both classes in all lanes, then each lane keeps its own
+    __m128i v[3][2];
+    for(int half = 0; half < 2; half++) {
+      __m128i bgr0[3], bgr1[3];
+      malvar_site_sse2<C0>(s[half], bgr0);
+      malvar_site_sse2<C1>(s[half], bgr1);
+      for(int ch = 0; ch < 3; ch++)
+	v[ch][half] = _mm_or_si128(_mm_and_si128(even, bgr0[ch]), _mm_andnot_si128(even, bgr1[ch]));
+    }
+    ushort bgr[3][8];
+    for(int ch = 0; ch < 3; ch++)
+      _mm_storeu_si128((__m128i*)bgr[ch], malvar_descale_sse2(v[ch][0], v[ch][1]));
+    ushort* o = out + x*3;
+    for(int i = 0; i < 8; i++) {
+      o[i*3] = bgr[0][i];
+      o[i*3+1] = bgr[1][i];
+      o[i*3+2] = bgr[2][i];
+    }
+  }
+  return x;
+}
+#endif
+
+// evaluate the sites [x,x1) of one row, where column x is of class C0
+// and the columns alternate with C1. the row pointers must be valid for
+// columns x-2..x1+1. with both classes known at compile time the loop
+// has no branches.
+template<int C0, int C1, int DCN, typename ST, typename DT, typename WT>
+static void malvar_span(const ST* const* r, DT* out, int x, int x1) {
+  x = malvar_span_simd<C0,C1,DCN>(r, out, x, x1);
+  for(; x + 1 < x1; x += 2) {
+    malvar_store<C0,DCN,WT>(r, out, x);
+    malvar_store<C1,DCN,WT>(r, out, x+1);
+  }
+  if(x < x1)
+    malvar_store<C0,DCN,WT>(r, out, x);
+}
+
+// picks the malvar_span instance for the site classes of a row
+template<int DCN, typename ST, typename DT, typename WT>
+struct MalvarSpans {
+  typedef void (*Span)(const ST* const*, DT*, int, int);
+  template<int C0> static Span get(int c1) {
+    switch(c1) {
+    case SITE_R: return malvar_span<C0,SITE_R,DCN,ST,DT,WT>;
+    case SITE_B: return malvar_span<C0,SITE_B,DCN,ST,DT,WT>;
+    case SITE_G_RROW: return malvar_span<C0,SITE_G_RROW,DCN,ST,DT,WT>;
+    default: return malvar_span<C0,SITE_G_BROW,DCN,ST,DT,WT>;
+    }
+  }
+  static Span get(int c0, int c1) {
+    switch(c0) {
+    case SITE_R: return get<SITE_R>(c1);
+    case SITE_B: return get<SITE_B>(c1);
+    case SITE_G_RROW: return get<SITE_G_RROW>(c1);
+    default: return get<SITE_G_BROW>(c1);
+    }
+  }
+};
+
+// evaluate and store one site of a class known only at run time
+template<typename ST, typename DT, typename WT>
+static inline void malvar_pixel_store(const ST* const* r, int x, int cls, int dcn, DT* out) {
+  if(dcn == 1) {
+    *out = malvar_descale<DT>(malvar_green<WT>(r, x, cls));
+  } else {
+    WT bgr[3];
+    malvar_pixel<WT>(r, x, cls, bgr);
+    out[0] = malvar_descale<DT>(bgr[0]);
+    out[1] = malvar_descale<DT>(bgr[1]);
+    out[2] = malvar_descale<DT>(bgr[2]);
+  }
+}
+
+// the same for a site whose 5x5 neighborhood crosses the left or right
+// edge of rows that are w columns wide, reflecting the columns as
+// filter2D does (BORDER_REFLECT_101)
+template<typename ST, typename DT, typename WT>
+static inline void malvar_border_store(const ST* const* rows, int x, int w, int cls, int dcn, DT* out) {
+  ST patch[5][5];
+  const ST* patchRows[5] = { patch[0], patch[1], patch[2], patch[3], patch[4] };
+  for(int j = 0; j < 5; j++) {
+    int xs = borderInterpolate(x+j-2, w, BORDER_REFLECT_101);
+    for(int k = 0; k < 5; k++)
+      patch[k][j] = rows[k][xs];
+  }
+  malvar_pixel_store<ST,DT,WT>(patchRows, 2, cls, dcn, out);
+}
+
+// evaluate the fused kernel for rows [y0,y1) of a single channel CFA
+// image, writing directly into the interleaved BGR output. borders are
+// handled as in filter2D (BORDER_REFLECT_101).
+template<typename ST, typename DT, typename WT>
+static void demosaic_rows(const Mat& src, Mat& dst, const int* cls, int y0, int y1) {
+  int w = src.cols;
+  int h = src.rows;
+  const ST* rows[5];
+  for(int y = y0; y < y1; y++) {
+    for(int k = 0; k < 5; k++)
+      rows[k] = src.ptr<ST>(borderInterpolate(y+k-2, h, BORDER_REFLECT_101));
+    const int* c = cls + (y&1)*2;
+    DT* out = dst.ptr<DT>(y);
+    // interior, then the two columns at each edge
+    int x0 = std::min(2, w), x1 = std::max(w - 2, x0);
+    if(x1 > x0)
+      MalvarSpans<3,ST,DT,WT>::get(c[0], c[1])(rows, out, x0, x1);
+    for(int x = 0; x < x0; x++)
+      malvar_border_store<ST,DT,WT>(rows, x, w, c[x&1], 3, out + x*3);
+    for(int x = x1; x < w; x++)
+      malvar_border_store<ST,DT,WT>(rows, x, w, c[x&1], 3, out + x*3);
+  }
+}
+
+// runs the fused kernel over a range of bands. bands only write their
+// own output rows and read their 2-row halo straight from the shared
+// source image, so they can run concurrently.
+template<typename ST, typename DT, typename WT>
+class DemosaicInvoker : public ParallelLoopBody {
+public:
+  DemosaicInvoker(const Mat& _src, Mat& _dst, const int* _cls) : src(_src), dst(_dst), cls(_cls) {}
+  void operator()(const Range& range) const {
+    int y0 = range.start * DEMOSAIC_BAND_ROWS;
+    int y1 = std::min(range.end * DEMOSAIC_BAND_ROWS, src.rows);
+    demosaic_rows<ST,DT,WT>(src, dst, cls, y0, y1);
+  }
+private:
+  const Mat& src;
+  Mat& dst;
+  const int* cls;
+};
+
+// run the fused kernel band by band over the whole image
+template<typename ST, typename DT, typename WT>
+static void demosaic_bands(const Mat& src, Mat& dst, const int* cls) {
+  run_parallel(band_count(src.rows), DemosaicInvoker<ST,DT,WT>(src, dst, cls));
 }
 
 Mat demosaic(Mat image_in, string cfaPattern) {
   // "High Quality Linear" (Malvar et al)
-  // convert to floating point, if necessary
-  Mat image;
-  if(image.depth()==CV_32F) {
-    image = image_in;
-  } else {
+  // perform no conversion of values
+
+  // Bayer pattern is case-insensitive
+  boost::to_lower(cfaPattern);
+
+  // classify the four sites of the Bayer cell
+  int cls[4];
+  for(int site = 0; site < 4; site++)
+    cls[site] = cfa_site_class(cfaPattern, site);
+
+  // compute R, G and B for every site in one pass, evaluating only the
+  // filters each site needs, and write straight into the output at the
+  // original image depth. 8 and 16 bit input is read in place and
+  // filtered in 32-bit integer arithmetic (the largest sum, 28 * 65535,
+  // fits easily); floating point input is read in place as well.
+  Mat out(image_in.size(), CV_MAKETYPE(image_in.depth(), 3));
+  switch(image_in.depth()) {
+  case CV_8U:  demosaic_bands<uchar,uchar,int>(image_in, out, cls); break;
+  case CV_8S:  demosaic_bands<schar,schar,int>(image_in, out, cls); break;
+  case CV_16U: demosaic_bands<ushort,ushort,int>(image_in, out, cls); break;
+  case CV_16S: demosaic_bands<short,short,int>(image_in, out, cls); break;
+  case CV_32F: demosaic_bands<float,float,float>(image_in, out, cls); break;
+  case CV_64F: demosaic_bands<double,double,double>(image_in, out, cls); break;
+  default: {
+    // 32-bit integers could overflow the fixed-point sums
+    Mat image;
     image_in.convertTo(image, CV_32F);
+    demosaic_bands<float,int,float>(image, out, cls);
+    break;
   }
-  // perform no conversion of values
+  }
+  return out;
+}
 
-  // collect metrics
-  int h, w;
-  Size S = image.size();
-  h = S.height;
-  w = S.width;
+// the bilinear weights of remap's INTER_TAB_SIZE x INTER_TAB_SIZE table
+// are multiples of 1/REMAP_WEIGHT_SCALE, so integer data is blended
+// exactly in fixed point with that scale; floating point data uses the
+// fractions themselves
+static const int REMAP_WEIGHT_BITS = 10;
+static const int REMAP_WEIGHT_SCALE = INTER_TAB_SIZE*INTER_TAB_SIZE;
+
+template<typename WT> static inline WT remap_weight(int n) {
+  return (WT)n / REMAP_WEIGHT_SCALE;
+}
+template<> inline int remap_weight<int>(int n) {
+  return n;
+}
+
+// remove the weight scale from a blended sample
+template<typename DT> static inline DT remap_descale(float v) {
+  return saturate_cast<DT>(v);
+}
+template<typename DT> static inline DT remap_descale(double v) {
+  return saturate_cast<DT>(v);
+}
+// fixed-point version: round to nearest and saturate
+template<typename DT> static inline DT remap_descale(int v) {
+  return saturate_cast<DT>((v + (1 << (REMAP_WEIGHT_BITS-1))) >> REMAP_WEIGHT_BITS);
+}
+
+// vectorized blends, which only exist for 16 bit data; they return the
+// column the scalar code continues from
+template<int DCN, typename ST, typename WT>
+static inline int remap_span_simd(const ST*, size_t, const short*, const ushort*, const WT (*)[4], ST*, int x, int) {
+  return x;
+}
+
+#ifdef DEMOSAIC_SSE2
+// 16 bit values as signed ones less 32768, which _mm_madd_epi16 can
+// multiply; the weights (at most REMAP_WEIGHT_SCALE) fit as they are
+static inline __m128i bias_u16(__m128i v) {
+  return _mm_xor_si128(v, _mm_set1_epi16((short)0x8000));
+}
+
+// the 16 bit values of four biased blends, whose weights sum to
+// REMAP_WEIGHT_SCALE so that the bias is exactly 32768 once descaled
+static inline __m128i remap_descale_sse2(__m128i v) {
+  v = _mm_srai_epi32(_mm_add_epi32(v, _mm_set1_epi32(1 << (REMAP_WEIGHT_BITS-1))), REMAP_WEIGHT_BITS);
+  return bias_u16(_mm_packs_epi32(v, v));
+}
+
+// the weights of a table entry as 16 bit pairs, left and right taps of
+// the top row in lane 0 and of the bottom row in lane 1
+static inline __m128i load_weights_sse2(const int* w) {
+  __m128i v = _mm_loadu_si128((const __m128i*)w);
+  return _mm_packs_epi32(v, v);
+}
+
+// the left and right tap of one row of a single channel pixel
+static inline __m128i load_pair_u16(const ushort* s) {
+  int pair;
+  memcpy(&pair, s, sizeof(pair));
+  return _mm_cvtsi32_si128(pair);
+}
+
+// blend 16 bit pixels whose taps all lie in the rows of src (step
+// elements apart), four single channel pixels or one BGR pixel at a time.
+// each tap is multiplied and added to its row neighbor by _mm_madd_epi16
+template<int DCN>
+static inline int remap_span_simd(const ushort* src, size_t step, const short* xy, const ushort* alpha, const int (*wtab)[4],
+				  ushort* out, int x, int x1) {
+  const int mask = INTER_TAB_SIZE*INTER_TAB_SIZE-1;
+  if(DCN == 1) {
+    for(; x + 4 <= x1; x += 4) {
+      __m128i top[4], bottom[4], w[4];
+      for(int i = 0; i < 4; i++) {
+	const ushort* s = src + xy[(x+i)*2+1]*step + xy[(x+i)*2];
+	top[i] = load_pair_u16(s);
+	bottom[i] = load_pair_u16(s + step);
+	w[i] = load_weights_sse2(wtab[alpha[x+i] & mask]);
+      }
+      // the tap pairs and weight pairs of the four pixels side by side
+      __m128i t = _mm_unpacklo_epi64(_mm_unpacklo_epi32(top[0], top[1]), _mm_unpacklo_epi32(top[2], top[3]));
+      __m128i b = _mm_unpacklo_epi64(_mm_unpacklo_epi32(bottom[0], bottom[1]), _mm_unpacklo_epi32(bottom[2], bottom[3]));
+      __m128i w01 = _mm_unpacklo_epi32(w[0], w[1]), w23 = _mm_unpacklo_epi32(w[2], w[3]);
+      __m128i sum = _mm_add_epi32(_mm_madd_epi16(bias_u16(t), _mm_unpacklo_epi64(w01, w23)),
+				  _mm_madd_epi16(bias_u16(b), _mm_unpackhi_epi64(w01, w23)));
+      _mm_storel_epi64((__m128i*)(out + x), remap_descale_sse2(sum));
+    }
+  } else {
+    for(; x < x1; x++) {
+      // the channels of the left tap interleaved with those of the right one
+      const ushort* s0 = src + xy[x*2+1]*step + xy[x*2]*3;
+      const ushort* s1 = s0 + step;
+      __m128i t = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)s0), _mm_srli_epi64(_mm_loadl_epi64((const __m128i*)(s0 + 2)), 16));
+      __m128i b = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)s1), _mm_srli_epi64(_mm_loadl_epi64((const __m128i*)(s1 + 2)), 16));
+      __m128i w = load_weights_sse2(wtab[alpha[x] & mask]);
+      __m128i sum = _mm_add_epi32(_mm_madd_epi16(bias_u16(t), _mm_shuffle_epi32(w, 0)),
+				  _mm_madd_epi16(bias_u16(b), _mm_shuffle_epi32(w, 0x55)));
+      ushort bgr[8];
+      _mm_storeu_si128((__m128i*)bgr, remap_descale_sse2(sum));
+      out[x*3] = bgr[0];
+      out[x*3+1] = bgr[1];
+      out[x*3+2] = bgr[2];
+    }
+  }
+  return x;
+}
+#endif
+
+// blend the pixels [x,x1) of a row whose taps all lie in the rows of src
+// (step elements apart)
+template<int DCN, typename ST, typename WT>
+static void remap_span(const ST* src, size_t step, const short* xy, const ushort* alpha, const WT (*wtab)[4],
+		       ST* out, int x, int x1) {
+  x = remap_span_simd<DCN>(src, step, xy, alpha, wtab, out, x, x1);
+  for(; x < x1; x++) {
+    const ST* s0 = src + xy[x*2+1]*step + xy[x*2]*DCN;
+    const ST* s1 = s0 + step;
+    const WT* w = wtab[alpha[x] & (INTER_TAB_SIZE*INTER_TAB_SIZE-1)];
+    for(int k = 0; k < DCN; k++)
+      out[x*DCN+k] = remap_descale<ST>(s0[k]*w[0] + s0[k+DCN]*w[1] + s1[k]*w[2] + s1[k+DCN]*w[3]);
+  }
+}
+
+// the bounds of n entries of a CV_16SC2 map, which callers start at
+// INT_MAX and INT_MIN
+static void map_bounds(const short* xy, int n, int& xmin, int& xmax, int& ymin, int& ymax) {
+  int x = 0;
+#ifdef DEMOSAIC_SSE2
+  if(n >= 4) {
+    // x in the even lanes, y in the odd ones
+    __m128i vmin = _mm_set1_epi16(SHRT_MAX), vmax = _mm_set1_epi16(SHRT_MIN);
+    for(; x + 4 <= n; x += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(xy + x*2));
+      vmin = _mm_min_epi16(vmin, v);
+      vmax = _mm_max_epi16(vmax, v);
+    }
+    short lmin[8], lmax[8];
+    _mm_storeu_si128((__m128i*)lmin, vmin);
+    _mm_storeu_si128((__m128i*)lmax, vmax);
+    for(int i = 0; i < 8; i += 2) {
+      xmin = std::min(xmin, (int)lmin[i]);
+      xmax = std::max(xmax, (int)lmax[i]);
+      ymin = std::min(ymin, (int)lmin[i+1]);
+      ymax = std::max(ymax, (int)lmax[i+1]);
+    }
+  }
+#endif
+  for(; x < n; x++) {
+    xmin = std::min(xmin, (int)xy[x*2]);
+    xmax = std::max(xmax, (int)xy[x*2]);
+    ymin = std::min(ymin, (int)xy[x*2+1]);
+    ymax = std::max(ymax, (int)xy[x*2+1]);
+  }
+}
+
+// demosaics and remaps a CFA image with fixed-point remap tables
+// (CV_16SC2 + CV_16UC1), blending the demosaiced samples of the four
+// taps of each destination pixel bilinearly. each band of destination
+// rows first demosaics the source region its taps cover into a small
+// buffer with the row kernel above, so every source pixel is demosaiced
+// once per band instead of once per tap. a band whose taps spread over
+// a region much larger than the band (a strongly rotated map) demosaics
+// each tap on its own instead. the demosaic neighborhood may extend past
+// the ROI into the parent image, with BORDER_REFLECT_101 at the
+// parent's edges; remap taps outside the ROI are zero (BORDER_CONSTANT),
+// as in remap().
+template<typename ST, typename WT>
+class DemosaicRemapInvoker : public ParallelLoopBody {
+public:
+  DemosaicRemapInvoker(const Mat& _src, Mat& _dst, const Mat& _map1, const Mat& _map2, const int* _cls) :
+    src(_src), dst(_dst), map1(_map1), map2(_map2), cls(_cls), dcn(_dst.channels()) {
+    src.locateROI(whole, ofs);
+    // pointer to pixel (0,0) of the parent image
+    base = src.data - ofs.y*src.step - ofs.x*src.elemSize();
+    for(int i = 0; i < INTER_TAB_SIZE*INTER_TAB_SIZE; i++) {
+      int fx = i % INTER_TAB_SIZE;
+      int fy = i / INTER_TAB_SIZE;
+      wtab[i][0] = remap_weight<WT>((INTER_TAB_SIZE-fx)*(INTER_TAB_SIZE-fy));
+      wtab[i][1] = remap_weight<WT>(fx*(INTER_TAB_SIZE-fy));
+      wtab[i][2] = remap_weight<WT>((INTER_TAB_SIZE-fx)*fy);
+      wtab[i][3] = remap_weight<WT>(fx*fy);
+    }
+  }
+  void operator()(const Range& range) const {
+    Mat buffer; // demosaiced source region of the current band
+    for(int band = range.start; band < range.end; band++) {
+      int y0 = band * REMAP_BAND_ROWS;
+      int y1 = std::min(y0 + REMAP_BAND_ROWS, dst.rows);
+      Rect region = source_region(y0, y1);
+      if(region.area() > 0 && region.area() <= MAX_REGION_RATIO * dst.cols * (y1 - y0)) {
+	demosaic_region(region, buffer);
+	remap_rows(y0, y1, region, buffer);
+      } else {
+	remap_rows_per_tap(y0, y1);
+      }
+    }
+  }
+private:
+  // largest source region demosaiced for a band, relative to the band's
+  // size, beyond which the taps are demosaiced one at a time
+  static const int MAX_REGION_RATIO = 4;
+
+  // the part of the ROI the taps of destination rows [y0,y1) fall in
+  Rect source_region(int y0, int y1) const {
+    int xmin = INT_MAX, ymin = INT_MAX, xmax = INT_MIN, ymax = INT_MIN;
+    for(int y = y0; y < y1; y++)
+      map_bounds(map1.ptr<short>(y), dst.cols, xmin, xmax, ymin, ymax);
+    if(xmin > xmax)
+      return Rect();
+    // the second tap is one pixel right of and below the first
+    return Rect(xmin, ymin, xmax - xmin + 2, ymax - ymin + 2) & Rect(0, 0, src.cols, src.rows);
+  }
+
+  // demosaic a region of the ROI into a buffer of the output type
+  void demosaic_region(Rect region, Mat& buffer) const {
+    buffer.create(region.height, region.width, dst.type());
+    const ST* rows[5];
+    const ST* regionRows[5];
+    // columns of the region whose neighborhood stays inside the parent
+    int px0 = ofs.x + region.x;
+    int x0 = std::min(std::max(2 - px0, 0), region.width);
+    int x1 = std::max(std::min(whole.width - 2 - px0, region.width), x0);
+    for(int i = 0; i < region.height; i++) {
+      int y = region.y + i;
+      for(int k = 0; k < 5; k++) {
+	int py = borderInterpolate(ofs.y + y + k - 2, whole.height, BORDER_REFLECT_101);
+	rows[k] = (const ST*)(base + py*src.step);
+	regionRows[k] = rows[k] + px0;
+      }
+      const int* c = cls + (y&1)*2;
+      ST* out = buffer.ptr<ST>(i);
+      if(x1 > x0) {
+	int c0 = c[(region.x + x0)&1], c1 = c[(region.x + x0 + 1)&1];
+	if(dcn == 1)
+	  MalvarSpans<1,ST,ST,WT>::get(c0, c1)(regionRows, out, x0, x1);
+	else
+	  MalvarSpans<3,ST,ST,WT>::get(c0, c1)(regionRows, out, x0, x1);
+      }
+      for(int x = 0; x < x0; x++)
+	malvar_border_store<ST,ST,WT>(rows, px0 + x, whole.width, c[(region.x + x)&1], dcn, out + x*dcn);
+      for(int x = x1; x < region.width; x++)
+	malvar_border_store<ST,ST,WT>(rows, px0 + x, whole.width, c[(region.x + x)&1], dcn, out + x*dcn);
+    }
+  }
+
+  // whether all four taps of a pixel lie inside the ROI
+  bool taps_inside(const short* xy) const {
+    return (unsigned)xy[0] < (unsigned)(src.cols - 1) && (unsigned)xy[1] < (unsigned)(src.rows - 1);
+  }
+
+  // blend the demosaiced samples of the buffer for rows [y0,y1). runs of
+  // pixels whose taps all lie inside the ROI, and so inside the buffer,
+  // are blended without bounds checks; only the pixels around the edges
+  // of the ROI check each tap
+  void remap_rows(int y0, int y1, Rect region, const Mat& buffer) const {
+    size_t step = buffer.step / sizeof(ST);
+    // element (0,0) of the ROI relative to the buffer; only used with the
+    // offsets of taps inside the region
+    const ST* origin = buffer.ptr<ST>(0) - (ptrdiff_t)region.y*step - (ptrdiff_t)region.x*dcn;
+    for(int y = y0; y < y1; y++) {
+      const short* xy = map1.ptr<short>(y);
+      const ushort* alpha = map2.ptr<ushort>(y);
+      ST* out = dst.ptr<ST>(y);
+      for(int x = 0; x < dst.cols; ) {
+	int x1 = x;
+	while(x1 < dst.cols && taps_inside(xy + x1*2))
+	  x1++;
+	if(x1 > x) {
+	  if(dcn == 1)
+	    remap_span<1>(origin, step, xy, alpha, wtab, out, x, x1);
+	  else
+	    remap_span<3>(origin, step, xy, alpha, wtab, out, x, x1);
+	  x = x1;
+	}
+	while(x1 < dst.cols && !taps_inside(xy + x1*2))
+	  x1++;
+	for(; x < x1; x++)
+	  remap_edge_pixel(xy[x*2], xy[x*2+1], wtab[alpha[x] & (INTER_TAB_SIZE*INTER_TAB_SIZE-1)], region, buffer, out + x*dcn);
+      }
+    }
+  }
+
+  // blend a pixel with taps outside the ROI, which are zero
+  void remap_edge_pixel(int sx, int sy, const WT* w, Rect region, const Mat& buffer, ST* out) const {
+    WT acc[3] = { 0, 0, 0 };
+    for(int tap = 0; tap < 4; tap++) {
+      int tx = sx + (tap & 1);
+      int ty = sy + (tap >> 1);
+      if(tx < 0 || tx >= src.cols || ty < 0 || ty >= src.rows)
+	continue;
+      const ST* s = buffer.ptr<ST>(ty - region.y) + (tx - region.x)*dcn;
+      for(int k = 0; k < dcn; k++)
+	acc[k] += s[k] * w[tap];
+    }
+    for(int k = 0; k < dcn; k++)
+      out[k] = remap_descale<ST>(acc[k]);
+  }
+
+  // demosaic the four taps of each pixel of rows [y0,y1) on their own
+  void remap_rows_per_tap(int y0, int y1) const {
+    const ST* rows[6];
+    for(int y = y0; y < y1; y++) {
+      const short* xy = map1.ptr<short>(y);
+      const ushort* alpha = map2.ptr<ushort>(y);
+      ST* out = dst.ptr<ST>(y);
+      for(int x = 0; x < dst.cols; x++) {
+	int sx = xy[x*2];
+	int sy = xy[x*2+1];
+	const WT* w = wtab[alpha[x] & (INTER_TAB_SIZE*INTER_TAB_SIZE-1)];
+	WT acc[3] = { 0, 0, 0 };
+	// source rows sy-2..sy+3 cover the neighborhoods of both tap rows
+	if(sy >= -1 && sy < src.rows) {
+	  for(int k = 0; k < 6; k++) {
+	    int py = borderInterpolate(ofs.y + sy + k - 2, whole.height, BORDER_REFLECT_101);
+	    rows[k] = (const ST*)(base + py*src.step);
+	  }
+	}
+	for(int tap = 0; tap < 4; tap++) {
+	  int tx = sx + (tap & 1);
+	  int ty = sy + (tap >> 1);
+	  if(tx < 0 || tx >= src.cols || ty < 0 || ty >= src.rows || w[tap] == 0)
+	    continue;
+	  // saturate each demosaiced sample first, as a separate demosaic would
+	  ST s[3];
+	  const ST* const* r = rows + (tap >> 1);
+	  int c = cls[(ty&1)*2 + (tx&1)];
+	  int px = ofs.x + tx;
+	  if(px < 2 || px >= whole.width - 2)
+	    malvar_border_store<ST,ST,WT>(r, px, whole.width, c, dcn, s);
+	  else
+	    malvar_pixel_store<ST,ST,WT>(r, px, c, dcn, s);
+	  for(int k = 0; k < dcn; k++)
+	    acc[k] += s[k] * w[tap];
+	}
+	for(int k = 0; k < dcn; k++)
+	  out[x*dcn+k] = remap_descale<ST>(acc[k]);
+      }
+    }
+  }
+
+  const Mat& src;
+  Mat& dst;
+  const Mat& map1;
+  const Mat& map2;
+  const int* cls;
+  int dcn;
+  Size whole;
+  Point ofs;
+  const uchar* base;
+  WT wtab[INTER_TAB_SIZE*INTER_TAB_SIZE][4];
+};
+
+void demosaic_remap(InputArray _cfa, OutputArray _dst, InputArray _map1, InputArray _map2, string cfaPattern, int dcn) {
+  Mat cfa = _cfa.getMat();
+  Mat map1 = _map1.getMat();
+  Mat map2 = _map2.getMat();
+  if(cfa.channels() != 1)
+    throw std::runtime_error("CFA image must have a single channel");
+  if(map1.type() != CV_16SC2 || map2.type() != CV_16UC1 || map1.size() != map2.size())
+    throw std::runtime_error("maps must be the CV_16SC2 and CV_16UC1 pair made by initUndistortRectifyMap");
+  if(dcn != 1 && dcn != 3)
+    throw std::runtime_error("output must have 1 (green) or 3 (BGR) channels");
+  _dst.create(map1.size(), CV_MAKETYPE(cfa.depth(), dcn));
+  Mat dst = _dst.getMat();
 
   // Bayer pattern is case-insensitive
   boost::to_lower(cfaPattern);
+  int cls[4];
+  for(int site = 0; site < 4; site++)
+    cls[site] = cfa_site_class(cfaPattern, site);
 
-  // construct G channel
-  Mat G;
-  G.create(S, CV_32F);
-
-  // first, composite existing G pixels into G channel
-
-  // construct G mask
-  Mat gmask = repeat(g_kern(cfaPattern), h/2, w/2);
-  // copy G data into output image
-  image.copyTo(G, gmask);
-
-  // now interpolate rest of G pixels
-  Mat cfa2G = (Mat_<float>(5,5) <<
-	        0, 0,-1, 0, 0,
- 	        0, 0, 2, 0, 0,
-	       -1, 2, 4, 2,-1,
- 	        0, 0, 2, 0, 0,
- 	        0, 0,-1, 0, 0) / 8;
-  Mat iG;
-  filter2D(image, iG, CV_32F, cfa2G);
-  iG.copyTo(G, 1-gmask);
-
-  // now, R/B at B/R locations
-
-  // construct channels
-  Mat R, B;
-  R.create(S, CV_32F);
-  B.create(S, CV_32F);
-
-  // construct masks
-  Mat bmask = repeat(b_kern(cfaPattern), h/2, w/2);
-  Mat rmask = repeat(r_kern(cfaPattern), h/2, w/2);
-
-  // RB at RB locations from original image data
-  image.copyTo(R, rmask);
-  image.copyTo(B, bmask);
-
-  // interpolate RB at BR locations
-  Mat rb2br = (Mat_<float>(5,5) <<
-	      0, 0, -1.5, 0,    0,
-              0, 2,    0, 2,    0,
-	   -1.5, 0,    6, 0, -1.5,
-	      0, 2,    0, 2,    0,
-   	      0, 0, -1.5, 0,    0) / 8;
-  // R at B locations
-  Mat iRB;
-  filter2D(image, iRB, CV_32F, rb2br);
-  iRB.copyTo(B, rmask);
-  iRB.copyTo(R, bmask);
-
-  // RB at G in RB row, BR column
-  Mat rbatg_rbrow = (Mat_<float>(5,5) <<
-		    0,  0, 0.5,  0,  0,
-		    0, -1,   0, -1,  0,
-		   -1,  4,   5,  4, -1,
-		    0, -1,   0, -1,  0,
- 		    0,  0, 0.5,  0,  0) / 8;
-  // RB at G in BR row, RB column
-  Mat rbatg_rbcol = (Mat_<float>(5,5) <<
-		      0,  0, -1,  0,   0,
-		      0, -1,  4, -1,   0,
-		    0.5,  0,  5,  0, 0.5,
- 		      0, -1,  4, -1,   0,
- 		      0,  0, -1,  0,   0) / 8;
-
-  // construct masks
-  Mat ratg_rrow_mask = repeat(ratg_rrow_kern(cfaPattern), h/2, w/2);
-  Mat ratg_rcol_mask = repeat(ratg_rcol_kern(cfaPattern), h/2, w/2);
-  Mat batg_brow_mask = ratg_rcol_mask;
-  Mat batg_bcol_mask = ratg_rrow_mask;
-
-  filter2D(image, iRB, CV_32F, rbatg_rbrow);
-  // RB at G in RB row, BR column
-  iRB.copyTo(R,ratg_rrow_mask);
-  iRB.copyTo(B,batg_brow_mask);
-
-  // RB at G in BR row, RB column
-  filter2D(image, iRB, CV_32F, rbatg_rbcol);
-  iRB.copyTo(R,ratg_rcol_mask);
-  iRB.copyTo(B,batg_bcol_mask);
-
-  // construct color image from channels
-  Mat color, out;
-  vector<Mat> BGR(3);
-  BGR[0] = B;
-  BGR[1] = G;
-  BGR[2] = R;
-  merge(BGR, color);
-  // now convert output back to original image depth
-  color.convertTo(out, image_in.depth());
-  return out;
+  int nbands = (dst.rows + REMAP_BAND_ROWS - 1) / REMAP_BAND_ROWS;
+  switch(cfa.depth()) {
+  case CV_8U:  run_parallel(nbands, DemosaicRemapInvoker<uchar,int>(cfa, dst, map1, map2, cls)); break;
+  case CV_8S:  run_parallel(nbands, DemosaicRemapInvoker<schar,int>(cfa, dst, map1, map2, cls)); break;
+  case CV_16U: run_parallel(nbands, DemosaicRemapInvoker<ushort,int>(cfa, dst, map1, map2, cls)); break;
+  case CV_16S: run_parallel(nbands, DemosaicRemapInvoker<short,int>(cfa, dst, map1, map2, cls)); break;
+  case CV_32F: run_parallel(nbands, DemosaicRemapInvoker<float,float>(cfa, dst, map1, map2, cls)); break;
+  case CV_64F: run_parallel(nbands, DemosaicRemapInvoker<double,double>(cfa, dst, map1, map2, cls)); break;
+  default: throw std::runtime_error("unsupported CFA image depth");
+  }
 }
 
 void cfa_offset(std::string channel, std::string cfaPattern, int* off_x, int *off_y) {
@@ -201,18 +875,138 @@ Mat demosaic_thumb_lq(Mat cfa, string cfaPattern) {
 
 /// utility
 
-// cv::remap cannot operate in-place, so this function
-// simulates it.
-void inplace_remap(InputArray _src, OutputArray _dst, Mat xMap, Mat yMap) {
-  Mat src = _src.getMat();
-  _dst.create(src.size(), src.type());
-  Mat dst = _dst.getMat();
-  if(src.data==dst.data) { // in-place op requested
-    Mat remapped(src.size(), src.type()); // allocate new Mat
-    remap(src,remapped,xMap,yMap,INTER_NEAREST); // remap
-    remapped.copyTo(dst); // copy the data to the dst/src
-  } else { // otherwise proceed with not-in-place op
-    remap(src,dst,xMap,yMap,INTER_NEAREST);
+// a pixel of a given size in bytes, so the strided copies below can
+// move whole pixels of any type with plain assignments
+template<int N> struct cfa_pixel {
+  uchar bytes[N];
+};
+
+// row of the source image a quad mosaic (toQuad) or CFA image row
+// comes from. for odd sizes cfa_quad's last row has no source and
+// gets the out-of-range index rows.
+static int quad_source_index(int y, int n, bool toQuad) {
+  int n2 = n/2;
+  if(toQuad)
+    return y < n2 ? y * 2 : ((y - n2) * 2) + 1;
+  return y % 2 == 0 ? y / 2 : n2 + ((y - 1) / 2);
+}
+
+// deinterleave (toQuad) or interleave the columns of one row. s and d
+// must not overlap.
+template<typename E>
+static void quad_shuffle_row(const E* s, E* d, int cols, bool toQuad) {
+  int c2 = cols/2;
+  if(toQuad) {
+    for(int x = 0; x < c2; x++) {
+      d[x] = s[x*2];
+      d[c2+x] = s[x*2+1];
+    }
+    if(cols % 2 != 0)
+      memset(&d[cols-1], 0, sizeof(E)); // no source column
+  } else {
+    for(int x = 0; x < c2; x++) {
+      d[x*2] = s[x];
+      d[x*2+1] = s[c2+x];
+    }
+    if(cols % 2 != 0)
+      d[cols-1] = s[c2];
+  }
+}
+
+// strided shuffle of bands of rows from src into a separate dst
+template<typename E>
+class QuadShuffleInvoker : public ParallelLoopBody {
+public:
+  QuadShuffleInvoker(const Mat& _src, Mat& _dst, bool _toQuad) : src(_src), dst(_dst), toQuad(_toQuad) {}
+  void operator()(const Range& range) const {
+    int y1 = std::min(range.end * DEMOSAIC_BAND_ROWS, dst.rows);
+    for(int y = range.start * DEMOSAIC_BAND_ROWS; y < y1; y++) {
+      int sy = quad_source_index(y, src.rows, toQuad);
+      if(sy >= src.rows)
+	memset(dst.ptr(y), 0, dst.cols * sizeof(E)); // no source row
+      else
+	quad_shuffle_row<E>(src.ptr<E>(sy), dst.ptr<E>(y), src.cols, toQuad);
+    }
+  }
+private:
+  const Mat& src;
+  Mat& dst;
+  bool toQuad;
+};
+
+// in-place shuffle of the columns within each row of a band, using a
+// single row of scratch space per band
+template<typename E>
+class QuadShuffleColumnsInvoker : public ParallelLoopBody {
+public:
+  QuadShuffleColumnsInvoker(Mat& _img, bool _toQuad) : img(_img), toQuad(_toQuad) {}
+  void operator()(const Range& range) const {
+    vector<E> row(img.cols);
+    int y1 = std::min(range.end * DEMOSAIC_BAND_ROWS, img.rows);
+    for(int y = range.start * DEMOSAIC_BAND_ROWS; y < y1; y++) {
+      E* p = img.ptr<E>(y);
+      std::copy(p, p + img.cols, row.begin());
+      quad_shuffle_row<E>(&row[0], p, img.cols, toQuad);
+    }
+  }
+private:
+  Mat& img;
+  bool toQuad;
+};
+
+// in-place row permutation by following the cycles of the permutation,
+// so only one row of scratch space is needed
+static void quad_permute_rows(Mat& img, bool toQuad) {
+  int rows = img.rows - img.rows % 2; // the even part is a permutation
+  size_t rowBytes = img.cols * img.elemSize();
+  if(!toQuad && img.rows % 2 != 0) // odd row of quad_cfa duplicates row rows/2
+    memcpy(img.ptr(img.rows-1), img.ptr(rows/2), rowBytes);
+  vector<uchar> tmp(rowBytes);
+  vector<bool> done(rows, false);
+  for(int start = 0; start < rows; start++) {
+    if(done[start])
+      continue;
+    memcpy(&tmp[0], img.ptr(start), rowBytes);
+    int y = start;
+    for(;;) {
+      done[y] = true;
+      int next = quad_source_index(y, rows, toQuad);
+      if(next == start) {
+	memcpy(img.ptr(y), &tmp[0], rowBytes);
+	break;
+      }
+      memcpy(img.ptr(y), img.ptr(next), rowBytes);
+      y = next;
+    }
+  }
+  if(toQuad && img.rows % 2 != 0) // no source row
+    memset(img.ptr(img.rows-1), 0, rowBytes);
+}
+
+template<typename E>
+static void quad_shuffle(const Mat& src, Mat& dst, bool toQuad) {
+  if(src.data == dst.data) { // in-place op requested
+    run_parallel(band_count(dst.rows), QuadShuffleColumnsInvoker<E>(dst, toQuad));
+    quad_permute_rows(dst, toQuad);
+  } else {
+    run_parallel(band_count(dst.rows), QuadShuffleInvoker<E>(src, dst, toQuad));
+  }
+}
+
+// dispatch on pixel size; depth (1, 2, 4 or 8 bytes) times 1 to 4 channels
+static void quad_shuffle(const Mat& src, Mat& dst, bool toQuad) {
+  switch(src.elemSize()) {
+  case 1:  quad_shuffle<cfa_pixel<1> >(src, dst, toQuad); break;
+  case 2:  quad_shuffle<cfa_pixel<2> >(src, dst, toQuad); break;
+  case 3:  quad_shuffle<cfa_pixel<3> >(src, dst, toQuad); break;
+  case 4:  quad_shuffle<cfa_pixel<4> >(src, dst, toQuad); break;
+  case 6:  quad_shuffle<cfa_pixel<6> >(src, dst, toQuad); break;
+  case 8:  quad_shuffle<cfa_pixel<8> >(src, dst, toQuad); break;
+  case 12: quad_shuffle<cfa_pixel<12> >(src, dst, toQuad); break;
+  case 16: quad_shuffle<cfa_pixel<16> >(src, dst, toQuad); break;
+  case 24: quad_shuffle<cfa_pixel<24> >(src, dst, toQuad); break;
+  case 32: quad_shuffle<cfa_pixel<32> >(src, dst, toQuad); break;
+  default: throw std::runtime_error("unsupported image type");
   }
 }
 
@@ -226,28 +1020,8 @@ void cfa_quad(InputArray _src, OutputArray _dst) {
     throw std::runtime_error("input/output image size mismatch");
   if(dst.type() != src.type())
     throw std::runtime_error("input/output image type mismatch");
-  Mat xMap, yMap;
-  xMap.create(src.size(), CV_32F);
-  yMap.create(src.size(), CV_32F);
-  // build pixel-swapping map
-  int c2 = src.cols/2;
-  int r2 = src.rows/2;
-  for(int x = 0; x < src.cols; x++) {
-    for(int y = 0; y < src.rows; y++) {
-      if(x < c2) {
-	xMap.at<float>(y,x) = x * 2;
-      } else {
-	xMap.at<float>(y,x) = ((x - c2) * 2) + 1;
-      }
-      if(y < r2) {
-	yMap.at<float>(y,x) = y * 2;
-      } else {
-	yMap.at<float>(y,x) = ((y - r2) * 2) + 1;
-      }
-    }
-  }
   // perform pixel-swapping
-  inplace_remap(src,dst,xMap,yMap);
+  quad_shuffle(src,dst,true);
 }
 
 // convert the output of cfa_quad back into a CFA image
@@ -259,30 +1033,31 @@ void quad_cfa(InputArray _src, OutputArray _dst) {
     throw std::runtime_error("input/output image size mismatch");
   if(dst.type() != src.type())
     throw std::runtime_error("input/output image type mismatch");
-  Mat xMap, yMap;
-  xMap.create(src.size(), CV_32F);
-  yMap.create(src.size(), CV_32F);
-  // build pixel-swapping map
-  int c2 = src.cols/2;
-  int r2 = src.rows/2;
-  for(int x = 0; x < src.cols; x++) {
-    for(int y = 0; y < src.rows; y++) {
-      if(x % 2 == 0) {
-	xMap.at<float>(y,x) = x / 2;
-      } else {
-	xMap.at<float>(y,x) = c2 + ((x-1) / 2);
-      }
-      if(y % 2 == 0) {
-	yMap.at<float>(y,x) = y / 2;
-      } else {
-	yMap.at<float>(y,x) = r2 + ((y-1) / 2);
-      }
-    }
-  }
   // perform pixel-swapping
-  inplace_remap(src,dst,xMap,yMap);
+  quad_shuffle(src,dst,false);
 }
 
+// copy every other pixel of every other row, starting at the given
+// Bayer offset, into a half-size image
+template<typename E>
+class CfaChannelInvoker : public ParallelLoopBody {
+public:
+  CfaChannelInvoker(const Mat& _src, Mat& _dst, int _x, int _y) : src(_src), dst(_dst), x(_x), y(_y) {}
+  void operator()(const Range& range) const {
+    int y1 = std::min(range.end * DEMOSAIC_BAND_ROWS, dst.rows);
+    for(int yd = range.start * DEMOSAIC_BAND_ROWS; yd < y1; yd++) {
+      const E* s = src.ptr<E>(yd*2 + y) + x;
+      E* d = dst.ptr<E>(yd);
+      for(int xd = 0; xd < dst.cols; xd++)
+	d[xd] = s[xd*2];
+    }
+  }
+private:
+  const Mat& src;
+  Mat& dst;
+  int x, y;
+};
+
 // given a CFA image return one of the channels, which
 // will be a half-size image. channel specified as x and y
 // offsets each of which which must be 0 or 1.
@@ -299,12 +1074,21 @@ void cfa_channel(InputArray _src, OutputArray _dst, int x, int y) {
   int h2 = src.rows/2;
   if(dst.cols!=w2 || dst.rows!=h2)
     throw std::runtime_error("output image must be half the size of input image");
-  // create mosaic of channel quadrants
-  Mat quad(src.size(), src.type());
-  cfa_quad(src,quad);
-  // return the requested quadrant
-  Mat roi(quad, Rect(w2*x,h2*y,w2,h2));
-  roi.copyTo(dst);
+  // read the requested quadrant straight from the CFA image
+  int nbands = band_count(h2);
+  switch(src.elemSize()) {
+  case 1:  run_parallel(nbands, CfaChannelInvoker<cfa_pixel<1> >(src, dst, x, y)); break;
+  case 2:  run_parallel(nbands, CfaChannelInvoker<cfa_pixel<2> >(src, dst, x, y)); break;
+  case 3:  run_parallel(nbands, CfaChannelInvoker<cfa_pixel<3> >(src, dst, x, y)); break;
+  case 4:  run_parallel(nbands, CfaChannelInvoker<cfa_pixel<4> >(src, dst, x, y)); break;
+  case 6:  run_parallel(nbands, CfaChannelInvoker<cfa_pixel<6> >(src, dst, x, y)); break;
+  case 8:  run_parallel(nbands, CfaChannelInvoker<cfa_pixel<8> >(src, dst, x, y)); break;
+  case 12: run_parallel(nbands, CfaChannelInvoker<cfa_pixel<12> >(src, dst, x, y)); break;
+  case 16: run_parallel(nbands, CfaChannelInvoker<cfa_pixel<16> >(src, dst, x, y)); break;
+  case 24: run_parallel(nbands, CfaChannelInvoker<cfa_pixel<24> >(src, dst, x, y)); break;
+  case 32: run_parallel(nbands, CfaChannelInvoker<cfa_pixel<32> >(src, dst, x, y)); break;
+  default: throw std::runtime_error("unsupported image type");
+  }
 }
 
 void cfa_channel(InputArray _src, OutputArray _dst, std::string channel, std::string cfaPattern) {
@@ -313,6 +1097,41 @@ void cfa_channel(InputArray _src, OutputArray _dst, std::string channel, std::st
   cfa_channel(_src, _dst, x, y);
 }
 
+// blurs bands of rows of the four quadrants of a quad mosaic. each band
+// is filtered together with ksize/2 halo rows of its own quadrant, using
+// BORDER_ISOLATED so pixels of neighboring quadrants never leak in.
+class QuadBlurInvoker : public ParallelLoopBody {
+public:
+  QuadBlurInvoker(const Mat& _quads, Mat& _dst, int _ksize, double _sigma, int _nbands) :
+    quads(_quads), dst(_dst), ksize(_ksize), sigma(_sigma), nbands(_nbands) {}
+  void operator()(const Range& range) const {
+    int w2 = quads.cols / 2;
+    int h2 = quads.rows / 2;
+    int halo = ksize / 2;
+    for(int i = range.start; i < range.end; i++) {
+      int quadrant = i / nbands;
+      int y0 = (i % nbands) * DEMOSAIC_BAND_ROWS;
+      int y1 = std::min(y0 + DEMOSAIC_BAND_ROWS, h2);
+      Rect roi = Rect((quadrant % 2)*w2, (quadrant / 2)*h2, w2, h2);
+      Mat q(quads, roi);
+      Mat qDst(dst, roi);
+      int top = std::min(halo, y0);
+      int bottom = std::min(halo, h2 - y1);
+      Mat band = q.rowRange(y0 - top, y1 + bottom);
+      Mat blurred;
+      GaussianBlur(band,blurred,Size(ksize,ksize),sigma,0,BORDER_REFLECT|BORDER_ISOLATED);
+      Mat qDstBand = qDst.rowRange(y0, y1);
+      blurred.rowRange(top, top + y1 - y0).copyTo(qDstBand);
+    }
+  }
+private:
+  const Mat& quads;
+  Mat& dst;
+  int ksize;
+  double sigma;
+  int nbands;
+};
+
 // smooth a CFA image in CFA space; that is, convert
 // to quadrant mosaic, smooth each quadrant independently,
 // then convert back to CFA.
@@ -335,21 +1154,11 @@ void cfa_smooth(InputArray _src, OutputArray _dst, int ksize) {
     throw std::runtime_error("input/output image type mismatch");
   // compute sigma from ksize using standard formula
   double sigma = 0.3*((ksize-1)*0.5 - 1) + 0.8;
-  cfa_quad(src,dst); // split into quads
-  int w2 = src.size().width / 2;
-  int h2 = src.size().height / 2;
-  // for each quadrant
-  for(int x = 0; x < 2; x++) {
-    for(int y = 0; y < 2; y++) {
-      Rect roi = Rect(x*w2,y*h2,w2,h2);
-      Mat qRoi(dst, roi); // extract roi for that quadrant
-      Mat q(h2,w2,src.type()); // copy to new image to isolate GaussianBlur operation
-      qRoi.copyTo(q);
-      GaussianBlur(q,q,Size(ksize,ksize),sigma,0,BORDER_REFLECT); // apply blur inplace
-      // now copy back to ROI for later re-assembly
-      q.copyTo(qRoi);
-    }
-  }
+  Mat quads(src.size(), src.type());
+  cfa_quad(src,quads); // split into quads
+  // blur every band of every quadrant into the destination mosaic
+  int nbands = band_count(src.size().height / 2);
+  run_parallel(4 * nbands, QuadBlurInvoker(quads, dst, ksize, sigma, nbands));
   // convert destination back to CFA inplace
   quad_cfa(dst,dst);
 }
@@ -6,7 +6,26 @@
  *
  * Also includes utilities for accessing and processing individual
  * channels of RAW images without demosaicing.
+ *
+ * All functions split their work into bands of rows and run them in
+ * parallel with cv::parallel_for_. See demosaic_set_num_threads.
+ */
+
+/**
+ * Limit the number of threads any one call of the functions in this
+ * file uses. Batch jobs that already process several frames at once
+ * can use this to divide cores between frame-level and intra-frame
+ * parallelism.
+ *
+ * @param nthreads the maximum number of threads per call; 1 runs
+ * serially, 0 (the default) leaves the choice to OpenCV
  */
+void demosaic_set_num_threads(int nthreads);
+
+/**
+ * @return the thread limit set with demosaic_set_num_threads
+ */
+int demosaic_get_num_threads();
 
 /**
  * Demosaic a color-filter-array (a.k.a. "RAW") image and produce
@@ -18,8 +37,10 @@
  * http://research.microsoft.com/apps/pubs/default.aspx?id=102068
  *
  * Any input type is supported. The output type will match the input
- * type. Internally, all computations are done in 32-bit floating
- * point.
+ * type. 8- and 16-bit input is filtered in place with 32-bit integer
+ * arithmetic and saturated on output; floating point input is filtered
+ * in place at its own precision. 32-bit integer input is converted to
+ * 32-bit floating point first.
  *
  * @param cfa the color filter array (CFA) patterned image
  *
@@ -30,6 +51,41 @@
  */
 cv::Mat demosaic(cv::Mat cfa, std::string cfaPattern="rggb");
 
+/**
+ * Demosaic a color-filter-array (a.k.a. "RAW") image and remap it
+ * (e.g. to undistort and rectify it) in a single pass.
+ *
+ * The result equals demosaic() followed by cv::remap() with linear
+ * interpolation and a constant zero border, but the demosaic is only
+ * evaluated over the source region each band of output rows touches
+ * and the full-size color image is never materialized. Integer images
+ * are blended with fixed-point weights and rounded once, so a small
+ * fraction of the samples differ from cv::remap() by 1.
+ *
+ * If cfa is a region of interest of a larger image, pixels of the
+ * parent image just outside it are used by the demosaic filters, as
+ * OpenCV filters do. Remap samples outside the region are zero.
+ *
+ * @param cfa the single-channel CFA image (any depth but 32-bit int)
+ *
+ * @param dst the output color (BGR) or green image, the size of the
+ * maps and the depth of cfa
+ *
+ * @param map1 the CV_16SC2 integer source coordinates made by
+ * cv::initUndistortRectifyMap or cv::convertMaps
+ *
+ * @param map2 the matching CV_16UC1 interpolation table indices
+ *
+ * @param cfaPattern the Bayer pattern at the top-left pixel of cfa;
+ * one of "rggb", "bggr", "grbg", or "gbrg". Case insensitive.
+ *
+ * @param dcn 3 for a color (BGR) result, or 1 to interpolate and
+ * remap only the green channel, which needs one filter at R and B
+ * sites and none at G sites
+ */
+void demosaic_remap(cv::InputArray cfa, cv::OutputArray dst, cv::InputArray map1, cv::InputArray map2,
+		    std::string cfaPattern="rggb", int dcn=3);
+
 /**
  * Demosaic a color-filter-array (a.k.a. "RAW") image and produce
  * a half-sized three-channel color image (BGR).
@@ -15,9 +15,10 @@
 
 #include "GlobalDefines.h"
 #include "StereoStructDefines.h"	// needed for camera matrix and point cloud structs, as well as point cloud file enum
-#include "AltitudeFromStereo.h"		// needed for doing the bulk of the computation
+#include "ProcessImageList.h"		// needed for doing the bulk of the computation
 #include "FileIO.h"
 #include "DataIO.h"					// needed for output of point cloud file
+#include "RectifyImage.h"			// needed to seed the rectification map cache
 #include "demosaic.hpp"
 
 #include <opencv2/core/core.hpp>
@@ -31,9 +32,7 @@ using namespace std;
 int main(int argc, char** argv)
 {
 	Parameters parameter;
-	PointCloud pointCloud;
 	CameraMatrix cameraMatrix;
-	Mat image, imageRectified;
 
 	// get user parameters from file
 	if (argc >= 2)
@@ -52,74 +51,53 @@ int main(int argc, char** argv)
 
 	// validate and print the parameters for this run
 	ValidateRuntimeParameters(parameter, RECTIFY);
+	bool ingest = parameter.ingestStdin || !parameter.ingestDirectory.empty();
+	if (ingest && !ValidateIngestParameters(parameter))
+		return -1;
+
+	// limit the threads used to demosaic a single frame
+	demosaic_set_num_threads(parameter.demosaicThreadCount);
+
+	// combine the altitude logs of a sharded run into one log, which is all that is done in this run
+	if (parameter.mergeShardLogs)
+		return MergeShardLogs(parameter.altitudeLogFile, parameter.shardCount) ? 0 : -1;
 
 	//*********************************************** NEEDED FOR COMPUTATION SECTION BELOW ****************************
-	// get the intrinsic and extrinsic matrices from previous calibration
-	if (!ReadCameraMatrices(parameter.calibrationDataDirectory, cameraMatrix))
+	// get the camera matrices and precomputed rectification maps from previous calibration,
+	// falling back to the intrinsic and extrinsic matrix files if the binary file is not available
+	RectificationMaps rectificationMaps;
+	if (ReadRectificationFile(parameter.calibrationDataDirectory, cameraMatrix, rectificationMaps))
+		AddRectificationMaps(cameraMatrix, rectificationMaps);
+	else if (!ReadCameraMatrices(parameter.calibrationDataDirectory, cameraMatrix))
 	{
 		cout << "Error in ReadCameraMatrices: Can't open/find the intrinsic/extrinsic matrix file" << endl;
 		return -1;
 	}
 	//******************************************************************************************************************
 
-	// get the list of images to be rectified
+	// process the frames of a live run as they arrive instead of a list
+	if (ingest)
+	{
+		FrameIngest ingest(parameter);
+		ProcessIngestedFrames(ingest, cameraMatrix, parameter);
+		return 0;
+	}
+
+	// get the list of images to be rectified (this run's shard and frame range of it) and their frame numbers in the list
 	vector<string> inputList, outputList;
-	bool ok = ReadTwoImageListsFromFile(parameter.rectificationImageListFile, inputList, outputList);
+	vector<int> frameNumbers;
+	bool ok = ReadTwoImageListsFromFile(parameter.rectificationImageListFile, inputList, outputList, frameNumbers,
+		parameter.shardIndex, parameter.shardCount, parameter.firstFrame, parameter.lastFrame);
 	if(!ok || inputList.empty() || outputList.empty())
 	{
-		cout << "Error in ReadTwoImageListsFromFile: Cannot open the image list file" << parameter.rectificationImageListFile << " or the list is empty" << endl;
+		cout << "Error in ReadTwoImageListsFromFile: Cannot open the image list file" << parameter.rectificationImageListFile << " or the list (or shard) is empty" << endl;
 		return -1;
 	}
+	if (parameter.shardCount > 1)
+		cout << "Shard " << parameter.shardIndex << " of " << parameter.shardCount << ": frames " << frameNumbers.front() << " to " << frameNumbers.back() << endl;
 
 	// process the images in the list of file names
-	for (int i=0; i<(int)inputList.size(); i++)
-	{
-		// read the image to be processed
-		Mat image = imread(inputList[i], CV_LOAD_IMAGE_ANYCOLOR | CV_LOAD_IMAGE_ANYDEPTH);
-		if (image.empty())
-		{
-			cout << "Error in mainRectify: unable to either find or read image " << inputList[i] << endl;
-			continue;
-		}
-
-		// check for tiff files and debayer if so (output is CV_U16C3 matrix type)
-		unsigned found = (unsigned)inputList[i].find_last_of(".");
-		if (inputList[i].substr(found+1) == "tif" || inputList[i].substr(found+1) == "tiff")
-		{
-			//cvtColor(image, image, CV_BayerBG2BGR);		// CV_BayerBG2BGR is RGGB
-			image = demosaic(image, "RGGB");
-		}
-
-		//***************************** THIS SECTION IS WHERE WE DO ALL THE WORK ******************************************
-
-		// input image and cameraMatrix, output imageRectified and pointCloud (and altitude of course)
-		cout << "Computing rectification, point cloud and altitude " << i+1 << " of " << inputList.size() << endl;
-		float altitude = AltitudeFromStereo(image, cameraMatrix, imageRectified, pointCloud,
-			parameter.doNotRectify, parameter.displayRectifiedImage, parameter.displayDisparityImage, parameter.pauseForKeystroke);
-
-		// check altitude for a valid range (1 to 3 1/2 meters perhaps?) and save data if okay
-		if (altitude < 1000.0f || altitude > 3500.0f)
-		{
-			cout << "Invalid computed altitude. Skipping file " << inputList[i] << endl;
-			continue;
-		}
-		else
-		{
-			// save the rectified image pair to disk
-			if (!parameter.doNotRectify)
-			{
-				cout << "Saving rectified image pair" << endl;
-				if (!imwrite(outputList[i], imageRectified))
-					cout << endl << "ERROR in function WritePointCloud: Could not open/save " << outputList[i] << endl;
-			}
-			// save the point cloud to disk
-			cout << "Saving point cloud" << endl;
-			string filename = "C:/Users/Peterh~1/Desktop/PointCloud" + toString(i);	//*********** TEMPORARY UNTIL WE AGREE ON WHERE IT SHOULD GO *******
-			if (!WritePointCloud(filename, pointCloud, imageRectified, PC_BINARY))
-				cout << endl << "ERROR in function WritePointCloud: Could not open/save " << filename << endl;
-		}
-		//*****************************************************************************************************************
-	}
+	ProcessImageList(inputList, outputList, frameNumbers, cameraMatrix, parameter);
 
 	// all done
 	return 0;